@@ -66,6 +66,9 @@
  * PB12---------------TX0
  * PB13---------------TX1
  *
+ * The logger PCB uses PA7, PC4 and PC5 as ADC inputs (IN7, IN14, IN15),
+ * PB12 as CAN2 RX and PB13 for the red LED, so no PHY can be fitted and
+ * HAL_USE_MAC stays off; the pin names above are from the reference board.
  *
  */
 
@@ -0,0 +1,104 @@
+/*===========================================================================*/
+// non-linear channel calibration, see calib.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "calib.h"
+#include "ccm.h"
+
+CCM_RAM static uint16_t calib_lut[CALIB_LUT_COUNT][CALIB_LUT_SIZE];
+
+int calib_parse(calib_curve_t *c, uint8_t kind, const char *args)
+{
+  char *end;
+  int max = (kind == CALIB_POLY) ? 4 : CALIB_MAX_POINTS * 2;
+  int n = 0;
+  float v;
+  
+  c->kind = CALIB_NONE;
+  c->count = 0;
+  
+  while (n < max)
+  {
+    v = (float)strtod(args, &end);
+    if (end == args) break;
+    c->p[n++] = v;
+    args = end;
+  }
+  
+  if (kind == CALIB_POLY)
+  {
+    if (n == 0) return 0;
+    while (n < 4) c->p[n++] = 0;
+    c->count = 4;
+  }
+  else
+  {
+    // at least one segment, x strictly ascending
+    if (n < 4 || (n & 1)) return 0;
+    for (max = 2; max < n; max += 2)
+      if (c->p[max] <= c->p[max - 2]) return 0;
+    c->count = n / 2;
+  }
+  
+  c->kind = kind;
+  return 1;
+}
+
+int calib_same(const calib_curve_t *a, const calib_curve_t *b)
+{
+  int n = (a->kind == CALIB_POLY) ? a->count : a->count * 2;
+  
+  if (a->kind != b->kind || a->count != b->count) return 0;
+  return memcmp(a->p, b->p, n * sizeof(float)) == 0;
+}
+
+float calib_eval(const calib_curve_t *c, float x)
+{
+  const float *p = c->p;
+  int i;
+  
+  if (c->kind == CALIB_POLY)
+    return p[0] + x * (p[1] + x * (p[2] + x * p[3]));
+  
+  if (c->kind == CALIB_PWL)
+  {
+    // segment containing x, the first and last ones extrapolate
+    for (i = 1; i < c->count - 1; i++)
+      if (x < p[i * 2]) break;
+    p += (i - 1) * 2;
+    return p[1] + (x - p[0]) * (p[3] - p[1]) / (p[2] - p[0]);
+  }
+  
+  return x;
+}
+
+const uint16_t *calib_build_lut(int slot, const calib_curve_t *c, float *zero, float *gain)
+{
+  uint16_t *lut;
+  float y_min, y_max, y, scale;
+  int i;
+  
+  if (slot < 0 || slot >= CALIB_LUT_COUNT || c->kind == CALIB_NONE) return 0;
+  lut = calib_lut[slot];
+  
+  // the interpolation stays between the points, their range is the table's
+  y_min = y_max = calib_eval(c, 0);
+  for (i = 1; i < CALIB_LUT_SIZE; i++)
+  {
+    y = calib_eval(c, i * CALIB_STEP);
+    if (y < y_min) y_min = y;
+    if (y > y_max) y_max = y;
+  }
+  if (y_max <= y_min) return 0;
+  
+  // full 16 bit range of the table is [y_min, y_max]
+  scale = 65535.0f / (y_max - y_min);
+  for (i = 0; i < CALIB_LUT_SIZE; i++)
+    lut[i] = (uint16_t)((calib_eval(c, i * CALIB_STEP) - y_min) * scale + 0.5f);
+  
+  *gain = (y_max - y_min) * (1 << CALIB_FRAC_BITS) / 65535.0f;
+  *zero = -y_min / *gain;
+  return lut;
+}
@@ -0,0 +1,58 @@
+/*===========================================================================*/
+// non-linear channel calibration: cubic polynomial or piecewise-linear
+// curve of the raw 12-bit ADC code, precomputed into a lookup table
+//
+// The table holds the curve quantized to 16 bits over its output range at
+// every 16th code, per sample the ADC callback interpolates between the two
+// points around the code (CALIB_LOOKUP). That is small enough for a table
+// per channel in both channel configs. The table values are
+// in the same 12.4 fixed point domain as raw codes shifted left by 4 (see
+// VLOG_VALUE_FRAC_BITS), the filter and both output formats work on them
+// unchanged, the curve's range goes into an effective zero/gain pair:
+//
+//   value = (CALIB_LOOKUP(lut, code) / 16 - zero) * gain
+
+#ifndef _CALIB_H_
+#define _CALIB_H_
+
+#include <stdint.h>
+
+#define CALIB_NONE          0
+#define CALIB_POLY          1 // c0 + c1*x + c2*x^2 + c3*x^3, VLOG_CALIB_POLY
+#define CALIB_PWL           2 // x0 y0 x1 y1 ..., x ascending, VLOG_CALIB_PWL
+
+#define CALIB_CODE_BITS     12
+#define CALIB_STEP_BITS     4  // codes from one table point to the next, log2
+#define CALIB_STEP          (1 << CALIB_STEP_BITS)
+#define CALIB_LUT_SIZE      ((1 << (CALIB_CODE_BITS - CALIB_STEP_BITS)) + 1) // the last point is code 4096
+#define CALIB_LUT_COUNT     16 // 8 channels, 2 configs; tables live in CCM, 514 bytes each
+#define CALIB_MAX_POINTS    16
+#define CALIB_FRAC_BITS     4  // raw code -> table domain shift
+
+// table value at a 12-bit code, linear between the points around it
+#define CALIB_LOOKUP(lut, code) \
+  ((uint16_t)(((lut)[(code) >> CALIB_STEP_BITS] * (CALIB_STEP - ((code) & (CALIB_STEP - 1))) + \
+               (lut)[((code) >> CALIB_STEP_BITS) + 1] * ((code) & (CALIB_STEP - 1)) + \
+               CALIB_STEP / 2) >> CALIB_STEP_BITS))
+
+typedef struct
+{
+  uint8_t kind;  // CALIB_xxx
+  uint8_t count; // polynomial coefficients or curve points
+  float p[CALIB_MAX_POINTS * 2];
+} calib_curve_t;
+
+// parses the arguments of a chN_poly / chN_pwl line, returns 1 if accepted
+int calib_parse(calib_curve_t *c, uint8_t kind, const char *args);
+
+float calib_eval(const calib_curve_t *c, float x);
+
+// 1 if both curves give the same table
+int calib_same(const calib_curve_t *a, const calib_curve_t *b);
+
+// builds table number slot from the curve, returns it or 0 if there is no
+// free table or the curve is constant; *zero and *gain are set so that
+// (CALIB_LOOKUP(lut, code) / 16 - zero) * gain is the curve value
+const uint16_t *calib_build_lut(int slot, const calib_curve_t *c, float *zero, float *gain);
+
+#endif /* _CALIB_H_ */
@@ -0,0 +1,228 @@
+/*===========================================================================*/
+// CAN bus capture, see can_capture.h
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "can_capture.h"
+#include "ccm.h"
+#include "timebase.h"
+
+can_bus_config_t can_bus_config[CAN_BUSES];
+uint32_t can_frames = 0;
+uint32_t can_ring_drops = 0;
+
+// single producer: both CAN ISRs have the same priority and never preempt
+// each other; single consumer: the formatter (CCM, the CPU moves the frames)
+CCM_RAM static can_record_t can_ring[CAN_RING_DEPTH];
+static volatile uint32_t can_ring_head = 0; // written by the ISRs only
+static volatile uint32_t can_ring_tail = 0; // written by the formatter only
+static BinarySemaphore *can_wake;
+static uint8_t can_running = 0;
+
+static CANConfig can_config[CAN_BUSES];
+static CANFilter can_filters[CAN_BUSES * CAN_FILTERS_MAX];
+
+void can_capture_defaults(void)
+{
+  int i;
+  
+  for (i = 0; i < CAN_BUSES; i++)
+  {
+    can_bus_config[i].bitrate = 0;
+    can_bus_config[i].silent = 1;
+    can_bus_config[i].filter_count = 0;
+  }
+}
+
+int can_capture_add_filter(int bus, uint32_t id, uint32_t mask, int ext)
+{
+  can_bus_config_t *c = &can_bus_config[bus];
+  
+  if (c->filter_count >= CAN_FILTERS_MAX) return 0;
+  
+  c->filter_ext[c->filter_count] = ext ? 1 : 0;
+  c->filter_id[c->filter_count] = id & (ext ? 0x1FFFFFFFUL : 0x7FFUL);
+  c->filter_mask[c->filter_count] = mask & (ext ? 0x1FFFFFFFUL : 0x7FFUL);
+  c->filter_count++;
+  return 1;
+}
+
+// called from the ISR of the bus for every received frame
+static void can_push(uint8_t bus, const CANRxFrame *crfp)
+{
+  uint32_t head = can_ring_head;
+  can_record_t *r;
+  
+  chSysLockFromIsr();
+  can_frames++;
+  if (head - can_ring_tail >= CAN_RING_DEPTH)
+  {
+    can_ring_drops++;
+  }
+  else
+  {
+    r = &can_ring[head & (CAN_RING_DEPTH - 1)];
+    r->stamp = timebase_nowI();
+    r->id = crfp->IDE ? crfp->EID : crfp->SID;
+    r->bus = bus;
+    r->flags = (crfp->IDE ? CAN_FRAME_EXT : 0) | (crfp->RTR ? CAN_FRAME_RTR : 0);
+    r->dlc = crfp->DLC;
+    memcpy(r->data, crfp->data8, 8);
+    can_ring_head = head + 1;
+    
+    // a few frames can wait for the next sample, a burst can not
+    if (head + 1 - can_ring_tail == CAN_RING_WAKE)
+      chBSemSignalI(can_wake);
+  }
+  chSysUnlockFromIsr();
+}
+
+static void can1_rx_cb(canmbx_t mailbox, const CANRxFrame *crfp)
+{
+  (void)mailbox;
+  can_push(0, crfp);
+}
+
+static void can2_rx_cb(canmbx_t mailbox, const CANRxFrame *crfp)
+{
+  (void)mailbox;
+  can_push(1, crfp);
+}
+
+// bit timing for bitrate: 16..8 time quanta per bit, sample point near 87.5%;
+// returns 0 if the CAN clock (APB1) can not be divided down to it exactly
+static uint32_t can_btr(uint32_t bitrate)
+{
+  uint32_t tq, brp, ts2;
+  
+  if (bitrate == 0) return 0;
+  
+  for (tq = 16; tq >= 8; tq--)
+  {
+    if (STM32_PCLK1 % (tq * bitrate) != 0) continue;
+    brp = STM32_PCLK1 / (tq * bitrate);
+    if (brp > 1024) continue;
+    
+    ts2 = (tq + 4) / 8;
+    if (ts2 < 2) ts2 = 2;
+    return CAN_BTR_SJW(0) | CAN_BTR_TS2(ts2 - 1) | CAN_BTR_TS1(tq - ts2 - 2) | CAN_BTR_BRP(brp - 1);
+  }
+  
+  return 0;
+}
+
+// 32-bit mask filter in FIFO 0; the IDE bit is compared for the filters of
+// the configuration, so standard and extended frames with the same number do
+// not match each other; ext < 0 - an all zero mask that takes every frame
+static void can_set_filter(CANFilter *f, uint32_t bank, uint32_t id, uint32_t mask, int ext)
+{
+  f->filter = bank;
+  f->mode = 0;
+  f->scale = 1;
+  f->assignment = 0;
+  if (ext < 0)
+  {
+    f->register1 = 0;
+    f->register2 = 0;
+  }
+  else
+  if (ext)
+  {
+    f->register1 = (id << 3) | 0x4;
+    f->register2 = (mask << 3) | 0x4;
+  }
+  else
+  {
+    f->register1 = id << 21;
+    f->register2 = (mask << 21) | 0x4;
+  }
+}
+
+int can_capture_start(BinarySemaphore *wake)
+{
+  uint32_t btr[CAN_BUSES];
+  uint32_t n = 0;
+  int bus, i;
+  
+  if (can_bus_config[0].bitrate == 0 && can_bus_config[1].bitrate == 0)
+    return 1; // nothing to capture
+  
+  for (bus = 0; bus < CAN_BUSES; bus++)
+  {
+    btr[bus] = 0;
+    if (can_bus_config[bus].bitrate == 0) continue;
+    
+    btr[bus] = can_btr(can_bus_config[bus].bitrate);
+    if (btr[bus] == 0) return 0;
+    if (bus == 1 || can_bus_config[bus].silent)
+      btr[bus] |= CAN_BTR_SILM;
+    
+    // the bus's own filters or one that takes everything, 11 and 29-bit
+    if (can_bus_config[bus].filter_count == 0)
+      can_set_filter(&can_filters[n++], bus * (STM32_CAN_MAX_FILTERS / 2), 0, 0, -1);
+    for (i = 0; i < can_bus_config[bus].filter_count; i++)
+      can_set_filter(&can_filters[n++], bus * (STM32_CAN_MAX_FILTERS / 2) + i,
+                     can_bus_config[bus].filter_id[i], can_bus_config[bus].filter_mask[i],
+                     can_bus_config[bus].filter_ext[i]);
+  }
+  
+  can_wake = wake;
+  can_ring_head = 0;
+  can_ring_tail = 0;
+  can_frames = 0;
+  can_ring_drops = 0;
+  
+  canSTM32SetFilters(STM32_CAN_MAX_FILTERS / 2, n, can_filters);
+  
+  // CAN1: the capture bus, or just the master of CAN2, then it runs in
+  // silent loop back mode, off the bus and without filters
+  can_config[0].mcr = CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_TXFP;
+  can_config[0].btr = btr[0] ? btr[0] : (btr[1] | CAN_BTR_LBKM);
+  can_config[0].rx_cb = can1_rx_cb;
+  if (can_bus_config[0].bitrate)
+  {
+    palSetPadMode(GPIOA, GPIOA_PIN11_CAN1_RX, PAL_MODE_ALTERNATE(9));
+    palSetPadMode(GPIOA, GPIOA_PIN12_CAN1_TX, PAL_MODE_ALTERNATE(9));
+  }
+  canStart(&CAND1, &can_config[0]);
+  
+  if (can_bus_config[1].bitrate)
+  {
+    can_config[1].mcr = CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_TXFP;
+    can_config[1].btr = btr[1];
+    can_config[1].rx_cb = can2_rx_cb;
+    canStart(&CAND2, &can_config[1]);
+  }
+  
+  can_running = 1;
+  return 1;
+}
+
+void can_capture_stop(void)
+{
+  if (!can_running) return;
+  
+  if (CAND2.state != CAN_STOP)
+    canStop(&CAND2);
+  canStop(&CAND1);
+  
+  palSetPadMode(GPIOA, GPIOA_PIN11_CAN1_RX, PAL_MODE_INPUT);
+  palSetPadMode(GPIOA, GPIOA_PIN12_CAN1_TX, PAL_MODE_INPUT);
+  can_running = 0;
+}
+
+const can_record_t *can_capture_peek(void)
+{
+  uint32_t tail = can_ring_tail;
+  
+  if (tail == can_ring_head) return 0;
+  return &can_ring[tail & (CAN_RING_DEPTH - 1)];
+}
+
+void can_capture_pop(void)
+{
+  can_ring_tail = can_ring_tail + 1;
+}
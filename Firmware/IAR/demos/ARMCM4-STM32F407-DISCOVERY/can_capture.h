@@ -0,0 +1,66 @@
+/*===========================================================================*/
+// CAN bus capture: the bxCAN receive FIFOs are emptied in the ISR into a frame
+// ring, every frame stamped from the same timebase as the ADC samples; the
+// formatter takes the frames out in time order between the sample records
+//
+// CAN1 is on PA11/PA12. CAN2 has only its RX pin (PB12) on this board, so it
+// always listens in silent mode, and it needs CAN1 running (filter banks and
+// clock are shared): CAN1 is started for it even if only CAN2 is used.
+// The ISRs run below the ADC and writer timer priorities, a busy bus delays
+// them but never the sampling.
+
+#ifndef _CAN_CAPTURE_H_
+#define _CAN_CAPTURE_H_
+
+#include "ch.h"
+
+#define CAN_BUSES           2
+#define CAN_FILTERS_MAX     7   // per bus, CAN1 uses filter banks 0.., CAN2 14..
+#define CAN_RING_DEPTH      256 // frames, must be power of 2
+#define CAN_RING_WAKE       (CAN_RING_DEPTH / 4) // the formatter is woken up at this fill
+
+#define CAN_FRAME_EXT       0x01 // 29-bit identifier
+#define CAN_FRAME_RTR       0x02 // remote frame
+
+typedef struct
+{
+  uint64_t stamp;   // timebase microseconds, when the ISR took the frame from the FIFO
+  uint32_t id;
+  uint8_t bus;      // 0 - CAN1, 1 - CAN2
+  uint8_t flags;    // CAN_FRAME_xxx
+  uint8_t dlc;
+  uint8_t data[8];
+} can_record_t;
+
+typedef struct
+{
+  uint32_t bitrate; // bit/s, 0 - bus not captured
+  uint8_t silent;   // 1 - listen only, the controller never drives the bus (no ACK)
+  uint8_t filter_count; // 0 - all frames
+  uint8_t filter_ext[CAN_FILTERS_MAX];
+  uint32_t filter_id[CAN_FILTERS_MAX];
+  uint32_t filter_mask[CAN_FILTERS_MAX];
+} can_bus_config_t;
+
+extern can_bus_config_t can_bus_config[CAN_BUSES];
+extern uint32_t can_frames;     // received since can_capture_start()
+extern uint32_t can_ring_drops; // lost because the formatter fell behind
+
+// all buses off, no filters
+void can_capture_defaults(void);
+
+// frames of bus with (frame id & mask) == (id & mask) are captured, the
+// others are dropped by the hardware; returns 0 if the bus has no free filter
+int can_capture_add_filter(int bus, uint32_t id, uint32_t mask, int ext);
+
+// starts the configured buses, wake is signalled when the ring fills up;
+// returns 0 if a bit rate can not be made from the CAN clock
+int can_capture_start(BinarySemaphore *wake);
+void can_capture_stop(void);
+
+// oldest frame in the ring or 0, formatter only; it stays there until
+// can_capture_pop()
+const can_record_t *can_capture_peek(void);
+void can_capture_pop(void);
+
+#endif /* _CAN_CAPTURE_H_ */
@@ -0,0 +1,22 @@
+/*===========================================================================*/
+// placement of CPU-only data in the 64K core coupled memory (CCM)
+//
+// CCM sits on the CPU D-bus only, so accessing it never competes with the
+// SDIO and ADC DMA streams for the SRAM bus matrix ports. DMA cannot reach
+// it either: ADC sample buffers, SD write buffers and FatFs objects (FATFS,
+// FIL) must stay in SRAM.
+//
+// The .ccm section is not initialized at startup (see iar/ch.icf and
+// gcc/STM32F407xG_CCM.ld), variables placed there must not have initializers
+// and have to be set up by code.
+
+#ifndef _CCM_H_
+#define _CCM_H_
+
+#if defined(__ICCARM__)
+#define CCM_RAM _Pragma("location=\".ccm\"") __no_init
+#else
+#define CCM_RAM __attribute__((section(".ccm")))
+#endif
+
+#endif /* _CCM_H_ */
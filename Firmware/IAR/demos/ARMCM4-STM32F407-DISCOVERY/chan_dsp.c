@@ -0,0 +1,115 @@
+/*===========================================================================*/
+// per-sample channel kernels: IIR filter and zero/gain calibration
+//
+// Compared to the old loop in the ADC callback the filter coefficients are
+// precomputed when the configuration is read, (N-1)/N and 1/N cost two
+// divisions per channel and sample otherwise, and enabled/disabled
+// channels are folded into the coefficients.
+//
+// Soft- and hard-float builds are compared with chan_dsp_bench(): build
+// once with CORTEX_USE_FPU FALSE and once with TRUE and run the console
+// bench command on each.
+
+#include "ch.h"
+#include "hal.h"
+
+#include "chan_dsp.h"
+#include "ccm.h"
+
+void chan_filter(float *state, const uint16_t *x, const float *a, const float *b, unsigned n)
+{
+  unsigned i;
+  
+  for (i = 0; i < n; i++)
+    state[i] = state[i] * a[i] + (float)x[i] * b[i];
+}
+
+void chan_calibrate(float *y, const float *x, const float *gain, const float *offset, unsigned n)
+{
+  unsigned i;
+  
+  for (i = 0; i < n; i++)
+    y[i] = x[i] * gain[i] + offset[i];
+}
+
+void chan_filter_coefs(float order, unsigned char enabled, float *a, float *b)
+{
+  if (!enabled)
+  {
+    *a = 1;
+    *b = 0;
+    return;
+  }
+  
+  if (order < 1) order = 1;
+  *a = (order - 1) / order;
+  *b = 1 / order;
+}
+
+/*===========================================================================*/
+// benchmark
+
+#define BENCH_MAX_CHANNELS  8
+
+CCM_RAM static float bench_state[BENCH_MAX_CHANNELS];
+CCM_RAM static float bench_a[BENCH_MAX_CHANNELS];
+CCM_RAM static float bench_b[BENCH_MAX_CHANNELS];
+CCM_RAM static float bench_order[BENCH_MAX_CHANNELS];
+CCM_RAM static uint8_t bench_en[BENCH_MAX_CHANNELS];
+CCM_RAM static uint16_t bench_x[BENCH_MAX_CHANNELS];
+
+// the filter as it was in the ADC callback before
+static void bench_legacy(unsigned n)
+{
+  unsigned i;
+  
+  for (i = 0; i < n; i++)
+  {
+    if (bench_en[i])
+      bench_state[i] = bench_state[i]*((bench_order[i] - 1)/bench_order[i]) + bench_x[i]/bench_order[i];
+  }
+}
+
+void chan_dsp_bench(chan_dsp_bench_t *res, unsigned channels, uint32_t frames)
+{
+  uint32_t f;
+  uint32_t start;
+  unsigned i;
+  
+  if (channels > BENCH_MAX_CHANNELS) channels = BENCH_MAX_CHANNELS;
+  if (frames == 0) frames = 1;
+  
+  for (i = 0; i < channels; i++)
+  {
+    bench_state[i] = 0;
+    bench_order[i] = 4;
+    bench_en[i] = 1;
+    bench_x[i] = 1000 + 100 * i;
+    chan_filter_coefs(bench_order[i], bench_en[i], &bench_a[i], &bench_b[i]);
+  }
+  
+  res->frames = frames;
+#if CORTEX_USE_FPU
+  res->fpu = 1;
+#else
+  res->fpu = 0;
+#endif
+  
+  // interrupts stay enabled, the numbers are averages over many frames;
+  // every kernel feeds its output back into the next frame, so none of the
+  // loops can be hoisted or dropped by the compiler
+  start = DWT->CYCCNT;
+  for (f = 0; f < frames; f++)
+    bench_legacy(channels);
+  res->legacy = (DWT->CYCCNT - start) / frames;
+  
+  start = DWT->CYCCNT;
+  for (f = 0; f < frames; f++)
+    chan_filter(bench_state, bench_x, bench_a, bench_b, channels);
+  res->filter = (DWT->CYCCNT - start) / frames;
+  
+  start = DWT->CYCCNT;
+  for (f = 0; f < frames; f++)
+    chan_calibrate(bench_state, bench_state, bench_a, bench_b, channels);
+  res->calibrate = (DWT->CYCCNT - start) / frames;
+}
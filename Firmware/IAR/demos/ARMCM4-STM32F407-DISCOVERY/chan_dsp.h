@@ -0,0 +1,36 @@
+/*===========================================================================*/
+// per-sample channel kernels: IIR filter and zero/gain calibration
+//
+// The kernels run over all channels of a frame at once, on contiguous
+// float arrays and without per-channel branches or divisions, so the
+// compiler keeps them in FPU registers (hard-float build, CORTEX_USE_FPU)
+// and unrolls them for the fixed channel count.
+
+#ifndef _CHAN_DSP_H_
+#define _CHAN_DSP_H_
+
+#include <stdint.h>
+
+// first order IIR, state = state*a + x*b per channel
+// disabled channels use a = 1, b = 0 and simply hold their value
+void chan_filter(float *state, const uint16_t *x, const float *a, const float *b, unsigned n);
+
+// y = x*gain + offset per channel, offset = -zero*gain
+void chan_calibrate(float *y, const float *x, const float *gain, const float *offset, unsigned n);
+
+// filter coefficients for an averaging order (order < 1 is taken as 1)
+void chan_filter_coefs(float order, unsigned char enabled, float *a, float *b);
+
+// cycles per frame of the kernels, measured with the DWT cycle counter
+typedef struct
+{
+  uint32_t frames;
+  uint32_t legacy;    // old per-channel filter with divisions and branches
+  uint32_t filter;    // chan_filter()
+  uint32_t calibrate; // chan_calibrate()
+  uint8_t fpu;        // 1 if built with CORTEX_USE_FPU
+} chan_dsp_bench_t;
+
+void chan_dsp_bench(chan_dsp_bench_t *res, unsigned channels, uint32_t frames);
+
+#endif /* _CHAN_DSP_H_ */
@@ -528,7 +528,12 @@
 
 /* NOTE: When changing this option you also have to enable or disable the FPU
    in the project options.*/
-#define CORTEX_USE_FPU                  FALSE
+#define CORTEX_USE_FPU                  TRUE
+
+/* The core sleeps in the idle thread, with the system tick suppressed until
+   the next virtual timer deadline.*/
+#define CORTEX_ENABLE_WFI_IDLE          TRUE
+#define CORTEX_TICKLESS_IDLE            TRUE
 
 #endif  /* _CHCONF_H_ */
 
@@ -23,6 +23,21 @@
 /  data transfer. This reduces memory consumption 512 bytes each file object. */
 
 
+#define	_FS_WINCACHE	4	/* 0:Disable or number of sectors cached */
+/* The _FS_WINCACHE option keeps FAT and directory sectors that leave win[] in
+/  a small cache (least recently used replacement), dirty sectors are written
+/  back on eviction or on sync, in sector order. Each slot takes _MAX_SS bytes
+/  in the file system object. It can not be used with _FS_TINY. */
+
+
+#define	_FS_FREEMAP	4096	/* 0:Disable or number of bits in the free cluster map */
+/* The _FS_FREEMAP option keeps one bit per range of FAT sectors telling if
+/  there is a free cluster in the range, so create_chain skips full parts
+/  of the FAT. f_scanfree builds the map (and the free cluster count) a few
+/  sectors at a time after mount. (_FS_FREEMAP / 8 + _MAX_SS) bytes in the file
+/  system object, not used on FAT12. */
+
+
 #define _FS_READONLY	0	/* 0:Read/Write or 1:Read only */
 /* Setting _FS_READONLY to 1 defines read only configuration. This removes
 /  writing functions, f_write, f_sync, f_unlink, f_mkdir, f_chmod, f_rename,
@@ -51,7 +66,7 @@
 /* To enable f_forward function, set _USE_FORWARD to 1 and set _FS_TINY to 1. */
 
 
-#define	_USE_FASTSEEK	0	/* 0:Disable or 1:Enable */
+#define	_USE_FASTSEEK	1	/* 0:Disable or 1:Enable */
 /* To enable fast seek feature, set _USE_FASTSEEK to 1. */
 
 
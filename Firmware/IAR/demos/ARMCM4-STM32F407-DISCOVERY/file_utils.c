@@ -5,32 +5,65 @@
 #include "hal.h"
 
 #include "ff.h"
+#include "vlog_format.h"
+#include "file_utils.h"
 
 extern FATFS SDC_FS;
-static SDCDriver SDCD1;
 
-static FIL file_sdc;
+// open files come from a pool: the log, its next segment, the segment list
+// and the config file or an index can be open together, plus two for the
+// console (cfg set copies the config file); every handle has its own FIL
+// sector buffer (SRAM, the SDIO DMA reads and writes it)
+#define FOPEN_MAX_FILES 6
+
+// cluster link maps for fast seek, a map of FCLMT_SIZE items holds
+// (FCLMT_SIZE - 2) / 2 fragments of the file
+#define FCLMT_SIZE 32
+
+struct file_obj
+{
+  FIL fil;
+  DWORD clmt[FCLMT_SIZE];
+};
+
+static file_t file_objs[FOPEN_MAX_FILES];
+static MEMORYPOOL_DECL(file_pool, sizeof(file_t), NULL);
 static FRESULT fres; // error code for fatfs calls
 extern bool_t fs_ready;
 
-FIL * fopen_( const char * fileName, const char *mode )
+// reads the cluster chain of an open file into its link map once, seeks
+// go without the FAT after that; returns 0 if the file is too fragmented
+int ffastseek_(file_t *fo)
+{
+  fo->clmt[0] = FCLMT_SIZE;
+  fo->fil.cltbl = fo->clmt;
+  if (f_lseek(&fo->fil, CREATE_LINKMAP) != FR_OK)
+  {
+    fo->fil.cltbl = 0;
+    return 0;
+  }
+  
+  return 1;
+}
+
+file_t * fopen_( const char * fileName, const char *mode )
 {
   BYTE attr = FA_READ;
-  FIL* File = &file_sdc;
+  file_t* fo = chPoolAlloc(&file_pool);
+  FIL* File;
+  
+  if (fo == 0)
+    return 0; // all handles in use
+  File = &fo->fil;
   
   if (mode[0] == 'a')
   {
-    fres = f_open(File, fileName, FA_WRITE | FA_OPEN_EXISTING );
-    if (fres != FR_OK)
-    {
-      // file does not exist, create it
-      fres = f_open(File, fileName, FA_WRITE | FA_OPEN_ALWAYS );
-    }
-    else
-    {
-      // rewind file to end for append write
+    // one directory lookup, creates the file if it is not there
+    fres = f_open(File, fileName, FA_WRITE | FA_OPEN_ALWAYS );
+    // rewind file to end for append write; a link map would have to walk
+    // the same chain to be built, so the plain seek it is
+    if (fres == FR_OK && f_size(File) > 0)
       fres = f_lseek(File, f_size(File));
-    }
   }
   else
   {
@@ -39,54 +72,200 @@ FIL * fopen_( const char * fileName, const char *mode )
       attr = FA_READ;
     else
     if (mode[0] == 'w')
-      attr = FA_WRITE | FA_OPEN_ALWAYS;
+      attr = FA_WRITE | FA_CREATE_ALWAYS;
     
     fres = f_open(File, fileName, attr);
   }
 
-  // if file opened -- return pointer to local variable
   if (fres == FR_OK) 
-    return File;
-  else
-    return 0;
+    return fo;
+  
+  chPoolFree(&file_pool, fo);
+  return 0;
+}
+
+// opens a new file for writing, the usual case for a log: no seek at all;
+// appends if the name is taken already (the RTC may have been reset)
+file_t * fcreate_( const char * fileName )
+{
+  file_t* fo = chPoolAlloc(&file_pool);
+  
+  if (fo == 0)
+    return 0; // all handles in use
+  
+  fres = f_open(&fo->fil, fileName, FA_WRITE | FA_CREATE_NEW);
+  if (fres == FR_OK) 
+    return fo;
+  
+  chPoolFree(&file_pool, fo);
+  if (fres == FR_EXIST)
+    return fopen_(fileName, "a");
+  return 0;
 }
 
-int fclose_(FIL   *fo)
+int fclose_(file_t *fo)
 {
-  //TODO: f_sync ?
+  // f_close syncs the file before it lets go of it
+  fres = f_close(&fo->fil);
   
-  if (f_close(fo) == FR_OK)
+  // the handle is free again even if the close failed
+  chPoolFree(&file_pool, fo);
+  
+  if (fres == FR_OK)
     return 0;
   else
     return EOF;
 }
 
-size_t fwrite_(const void *data_to_write, size_t size, size_t n, FIL *stream)
+size_t fwrite_(const void *data_to_write, size_t size, size_t n, file_t *stream)
 {
   UINT data_written;
   
-  fres = f_write(stream, data_to_write, size*n, &data_written);
+  fres = f_write(&stream->fil, data_to_write, size*n, &data_written);
   if (fres != FR_OK) return 0;
     
   return data_written;
 }
 
-size_t fread_(void *ptr, size_t size, size_t n, FIL *stream)
+size_t fread_(void *ptr, size_t size, size_t n, file_t *stream)
 {
   UINT data_written;
 
-  fres = f_read(stream, ptr, size*n, &data_written);
+  fres = f_read(&stream->fil, ptr, size*n, &data_written);
   if (fres != FR_OK) return 0;
    
   return data_written;
 }
 
+char * fgets_(char *s, int n, file_t *stream)
+{
+  return f_gets(s, n, &stream->fil);
+}
+
+int fputs_(const char *s, file_t *stream)
+{
+  return f_puts(s, &stream->fil);
+}
+
+int fsync_(file_t *stream)
+{
+  fres = f_sync(&stream->fil);
+  return fres == FR_OK ? 0 : EOF;
+}
+
+// moves the file pointer to ofs; past the end of a file open for writing
+// the file grows to ofs (clusters allocated, contents undefined)
+int fseek_(file_t *stream, DWORD ofs)
+{
+  fres = f_lseek(&stream->fil, ofs);
+  return fres == FR_OK ? 0 : EOF;
+}
+
+// cuts the file at the file pointer
+int ftruncate_(file_t *stream)
+{
+  fres = f_truncate(&stream->fil);
+  return fres == FR_OK ? 0 : EOF;
+}
+
+DWORD ftell_(file_t *stream)
+{
+  return f_tell(&stream->fil);
+}
+
+DWORD fsize_(file_t *stream)
+{
+  return f_size(&stream->fil);
+}
+
+int feof_(file_t *stream)
+{
+  return f_eof(&stream->fil);
+}
+
+static DWORD get_le32(const BYTE *p)
+{
+  return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+// reads index entry n: sample number, log file offset, time
+static int idx_entry(FIL *idx, DWORD n, DWORD *sample, DWORD *offset, uint64_t *time_us)
+{
+  BYTE e[VLOG_IDX_ENTRY_SIZE];
+  UINT br;
+  
+  if (f_lseek(idx, VLOG_IDX_HEADER_SIZE + n * VLOG_IDX_ENTRY_SIZE) != FR_OK) return 0;
+  if (f_read(idx, e, sizeof(e), &br) != FR_OK || br != sizeof(e)) return 0;
+  
+  *sample = get_le32(e);
+  *offset = get_le32(e + 4);
+  *time_us = get_le32(e + 8) | ((uint64_t)get_le32(e + 12) << 32);
+  return 1;
+}
+
+// last index entry with time <= t_us, the first one if t_us is before all
+// of them; n entries
+static int idx_search(FIL *idx, DWORD n, uint64_t t_us, DWORD *sample, DWORD *offset)
+{
+  DWORD lo, hi, mid;
+  DWORD s, o;
+  uint64_t t;
+  
+  lo = 0;
+  hi = n;
+  while (hi - lo > 1)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (!idx_entry(idx, mid, &s, &o, &t)) return 0;
+    if (t <= t_us)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return idx_entry(idx, lo, sample, offset, &t);
+}
+
+// positions log at the last indexed record at or before t_us (us since log start)
+// using its sidecar index (see vlog_format.h), the caller reads forward from
+// there; *sample gets the sample number of that record
+// idx must be open for reading, log may be open for writing: a link map made
+// for the probes is dropped again, f_write and f_lseek past a map would fail
+// returns 0 if the index is not usable, log is not moved then
+int fseek_time_(file_t *log_fo, file_t *idx_fo, uint64_t t_us, uint32_t *sample)
+{
+  FIL *log = &log_fo->fil, *idx = &idx_fo->fil;
+  BYTE h[VLOG_IDX_HEADER_SIZE];
+  UINT br;
+  DWORD n;
+  DWORD s, offset;
+  int mapped = 0, found;
+  
+  if (f_lseek(idx, 0) != FR_OK) return 0;
+  if (f_read(idx, h, sizeof(h), &br) != FR_OK || br != sizeof(h)) return 0;
+  if (get_le32(h) != VLOG_IDX_MAGIC || (h[6] | (h[7] << 8)) != VLOG_IDX_ENTRY_SIZE) return 0;
+  
+  // a partly written last entry is ignored
+  n = (f_size(idx) - VLOG_IDX_HEADER_SIZE) / VLOG_IDX_ENTRY_SIZE;
+  if (n == 0) return 0;
+  
+  // the probes jump around the index, they go through a link map
+  if (idx->cltbl == 0)
+    mapped = ffastseek_(idx_fo);
+  found = idx_search(idx, n, t_us, &s, &offset);
+  if (mapped)
+    idx->cltbl = 0;
+  if (!found || offset >= f_size(log)) return 0;
+  
+  // a single seek, building a link map for it would walk the same chain
+  if (f_lseek(log, offset) != FR_OK) return 0;
+  
+  *sample = s;
+  return 1;
+}
+
 int finit_(void)
 { 
-   /*
-   * Activates the SDC driver 1 using default configuration.
-   */
-
+  chPoolLoadArray(&file_pool, file_objs, FOPEN_MAX_FILES);
   
   return TRUE;
 }
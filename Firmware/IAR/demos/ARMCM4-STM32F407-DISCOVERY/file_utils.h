@@ -1,6 +1,20 @@
-FIL * fopen_( const char * fileName, const char *mode );
-int fclose_(FIL   *fo);
-size_t fwrite_(const void *data_to_write, size_t size, size_t n, FIL *stream);
-size_t fread_(void *ptr, size_t size, size_t n, FIL *stream);
+// open file handle from the file_utils pool, the FatFs object inside is
+// private to file_utils.c
+typedef struct file_obj file_t;
+
+file_t * fopen_( const char * fileName, const char *mode );
+file_t * fcreate_( const char * fileName );
+int ffastseek_(file_t *fo);
+int fseek_time_(file_t *log, file_t *idx, uint64_t t_us, uint32_t *sample);
+int fclose_(file_t *fo);
+size_t fwrite_(const void *data_to_write, size_t size, size_t n, file_t *stream);
+size_t fread_(void *ptr, size_t size, size_t n, file_t *stream);
+char * fgets_(char *s, int n, file_t *stream);
+int fputs_(const char *s, file_t *stream);
+int fsync_(file_t *stream);
+int fseek_(file_t *stream, DWORD ofs);
+int ftruncate_(file_t *stream);
+DWORD ftell_(file_t *stream);
+DWORD fsize_(file_t *stream);
+int feof_(file_t *stream);
 int finit_(void);
-#define feof_(stream) f_eof(stream)
\ No newline at end of file
@@ -55,14 +55,14 @@
  * @brief   Enables the CAN subsystem.
  */
 #if !defined(HAL_USE_CAN) || defined(__DOXYGEN__)
-#define HAL_USE_CAN                 FALSE
+#define HAL_USE_CAN                 TRUE
 #endif
 
 /**
  * @brief   Enables the EXT subsystem.
  */
 #if !defined(HAL_USE_EXT) || defined(__DOXYGEN__)
-#define HAL_USE_EXT                 FALSE
+#define HAL_USE_EXT                 TRUE
 #endif
 
 /**
@@ -88,6 +88,8 @@
 
 /**
  * @brief   Enables the MAC subsystem.
+ * @note    No Ethernet on the logger PCB, the RMII pins are ADC inputs
+ *          (see board.h).
  */
 #if !defined(HAL_USE_MAC) || defined(__DOXYGEN__)
 #define HAL_USE_MAC                 FALSE
@@ -125,7 +127,7 @@
  * @brief   Enables the SERIAL subsystem.
  */
 #if !defined(HAL_USE_SERIAL) || defined(__DOXYGEN__)
-#define HAL_USE_SERIAL              FALSE//TRUE
+#define HAL_USE_SERIAL              TRUE
 #endif
 
 /**
@@ -284,7 +286,7 @@
  *          buffers.
  */
 #if !defined(SERIAL_BUFFERS_SIZE) || defined(__DOXYGEN__)
-#define SERIAL_BUFFERS_SIZE         16
+#define SERIAL_BUFFERS_SIZE         128
 #endif
 
 /*===========================================================================*/
@@ -0,0 +1,230 @@
+/*===========================================================================*/
+// LZ4 block compressor with standard frame output (.lz4), for the CSV log
+//
+// Greedy single-probe LZ4 as in the reference LZ4_compress_fast(), sized
+// for one flush buffer per block: the hash table holds 16-bit positions, so
+// it stays at 8 KB and the block limit is 64 KB (BD = 64KB in the frame).
+// The caller provides the table, so it can share it with state of its own
+// that is not in use while compressing.
+// Every flush buffer becomes one complete frame, frames are simply
+// concatenated in the file, so `lz4 -d` reads the whole log and a cut file
+// still decodes up to the last complete flush.
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "lz4_block.h"
+
+#define LZ4_MIN_MATCH       4
+#define LZ4_LAST_LITERALS   5   // the block must end with literals
+#define LZ4_MF_LIMIT        12  // no match may start in the last 12 bytes
+#define LZ4_MAX_DISTANCE    0xFFFF
+
+#define LZ4_FRAME_MAGIC     0x184D2204UL
+#define LZ4_SKIP_MAGIC      0x184D2A50UL
+#define LZ4_FLG             0x60  // version 01, independent blocks, no checksums
+#define LZ4_BD              0x40  // max block size 64 KB
+#define LZ4_HC              0x82  // (xxh32(FLG, BD, seed 0) >> 8) & 0xFF
+
+uint32_t lz4_last_cycles = 0;
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash32(uint32_t sequence)
+{
+  return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+  return p + 4;
+}
+
+// length extension bytes of a token field
+static uint8_t *put_length(uint8_t *op, uint32_t length)
+{
+  while (length >= 255)
+  {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t)length;
+  return op;
+}
+
+// compresses src into a raw LZ4 block, returns its size or 0 if it does not
+// fit into dst_cap bytes
+uint32_t lz4_compress_block(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap,
+                            uint16_t *hash_table)
+{
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *iend = src + src_len;
+  const uint8_t *mflimit = iend - LZ4_MF_LIMIT;
+  const uint8_t *matchlimit = iend - LZ4_LAST_LITERALS;
+  const uint8_t *ref;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_cap;
+  uint8_t *token;
+  uint32_t literals, match_len, h;
+  
+  if (src_len > LZ4_MAX_INPUT)
+    return 0;
+  
+  if (src_len >= LZ4_MF_LIMIT + 1)
+  {
+    memset(hash_table, 0, (1 << LZ4_HASH_LOG) * sizeof(uint16_t));
+    ip++;
+    
+    while (ip < mflimit)
+    {
+      // find a match, position 0 is never a valid candidate, which lets the
+      // zeroed table mean "empty"
+      h = hash32(read32(ip));
+      ref = src + hash_table[h];
+      hash_table[h] = (uint16_t)(ip - src);
+      
+      if (ref == src || ip - ref > LZ4_MAX_DISTANCE || read32(ref) != read32(ip))
+      {
+        ip++;
+        continue;
+      }
+      
+      // extend backwards over the pending literals
+      while (ip > anchor && ref > src && ip[-1] == ref[-1])
+      {
+        ip--;
+        ref--;
+      }
+      
+      literals = (uint32_t)(ip - anchor);
+      
+      // worst case: token, literal length bytes, literals, offset
+      if (op + 1 + literals / 255 + 1 + literals + 2 > oend)
+        return 0;
+      
+      token = op++;
+      if (literals >= 15)
+      {
+        *token = 15 << 4;
+        op = put_length(op, literals - 15);
+      }
+      else
+        *token = (uint8_t)(literals << 4);
+      memcpy(op, anchor, literals);
+      op += literals;
+      
+      // offset
+      *op++ = (uint8_t)(ip - ref);
+      *op++ = (uint8_t)((ip - ref) >> 8);
+      
+      // match length
+      ip += LZ4_MIN_MATCH;
+      ref += LZ4_MIN_MATCH;
+      while (ip < matchlimit && *ip == *ref)
+      {
+        ip++;
+        ref++;
+      }
+      match_len = (uint32_t)(ip - anchor) - literals - LZ4_MIN_MATCH;
+      
+      if (op + 1 + match_len / 255 > oend)
+        return 0;
+      if (match_len >= 15)
+      {
+        *token |= 15;
+        op = put_length(op, match_len - 15);
+      }
+      else
+        *token |= (uint8_t)match_len;
+      
+      anchor = ip;
+      
+      // the position right before the next search is worth remembering
+      if (ip - 2 > src)
+        hash_table[hash32(read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+    }
+  }
+  
+  // last literals
+  literals = (uint32_t)(iend - anchor);
+  if (op + 1 + literals / 255 + 1 + literals > oend)
+    return 0;
+  
+  token = op++;
+  if (literals >= 15)
+  {
+    *token = 15 << 4;
+    op = put_length(op, literals - 15);
+  }
+  else
+    *token = (uint8_t)(literals << 4);
+  memcpy(op, anchor, literals);
+  op += literals;
+  
+  return (uint32_t)(op - dst);
+}
+
+// writes src as one complete LZ4 frame, the block is stored uncompressed
+// when it does not shrink; returns the frame size or 0 if dst_cap is too small
+uint32_t lz4_frame(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap, uint16_t *hash_table)
+{
+  uint8_t *op = dst;
+  uint32_t block;
+  uint32_t start = DWT->CYCCNT;
+  
+  if (dst_cap < src_len + LZ4_FRAME_OVERHEAD || src_len > LZ4_MAX_INPUT)
+    return 0;
+  
+  op = put_u32(op, LZ4_FRAME_MAGIC);
+  *op++ = LZ4_FLG;
+  *op++ = LZ4_BD;
+  *op++ = LZ4_HC;
+  
+  if (src_len > 0)
+  {
+    block = lz4_compress_block(src, src_len, op + 4, src_len - 1, hash_table);
+    if (block)
+    {
+      op = put_u32(op, block);
+    }
+    else
+    {
+      // incompressible, high bit marks an uncompressed block
+      block = src_len;
+      op = put_u32(op, block | 0x80000000UL);
+      memcpy(op, src, src_len);
+    }
+    op += block;
+  }
+  
+  op = put_u32(op, 0); // end mark
+  
+  lz4_last_cycles = DWT->CYCCNT - start;
+  
+  return (uint32_t)(op - dst);
+}
+
+// skippable frame of exactly length bytes (at least LZ4_SKIPPABLE_MIN),
+// used to pad the file to sector boundaries
+uint32_t lz4_put_skippable(uint8_t *dst, uint32_t length)
+{
+  uint8_t *p = put_u32(dst, LZ4_SKIP_MAGIC);
+  
+  p = put_u32(p, length - LZ4_SKIPPABLE_MIN);
+  memset(p, 0, length - LZ4_SKIPPABLE_MIN);
+  
+  return length;
+}
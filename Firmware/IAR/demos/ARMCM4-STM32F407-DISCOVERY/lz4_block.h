@@ -0,0 +1,23 @@
+/*===========================================================================*/
+// LZ4 block compressor with standard frame output (.lz4), for the CSV log
+
+#ifndef _LZ4_BLOCK_H_
+#define _LZ4_BLOCK_H_
+
+#include <stdint.h>
+
+#define LZ4_HASH_LOG        12        // 4096 entries, 8 KB table, given by the caller
+#define LZ4_MAX_INPUT       0xFFFF    // positions in the table are 16 bit
+
+// frame header + block size + end mark
+#define LZ4_FRAME_OVERHEAD  (7 + 4 + 4)
+#define LZ4_SKIPPABLE_MIN   8
+
+extern uint32_t lz4_last_cycles; // DWT cycles spent in the last lz4_frame()
+
+uint32_t lz4_compress_block(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap,
+                            uint16_t *hash_table);
+uint32_t lz4_frame(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_cap, uint16_t *hash_table);
+uint32_t lz4_put_skippable(uint8_t *dst, uint32_t length);
+
+#endif /* _LZ4_BLOCK_H_ */
@@ -24,6 +24,16 @@
 
 
 #include "file_utils.h"
+#include "timebase.h"
+#include "chrtclib.h"
+#include "vlog_bin.h"
+#include "lz4_block.h"
+#include "ccm.h"
+#include "chan_dsp.h"
+#include "calib.h"
+#include "can_capture.h"
+#include "serial_capture.h"
+#include <stdlib.h>
 #include <time.h>
 
 
@@ -36,43 +46,321 @@
 uint8_t bButton = 0;
 unsigned char bLogging = 0; // if =1 than we logging to SD card
 
+// the main loop sleeps until one of these or the button poll timeout
+#define EVT_WRITE   EVENT_MASK(0) // formatter handed a buffer to write
+#define EVT_AWD     EVENT_MASK(1) // analog watchdog event
+#define EVT_BUTTON  EVENT_MASK(2) // debounced button press
+#define EVT_CONSOLE EVENT_MASK(3) // the console needs the card or a config reload
+static Thread *main_tp;
+
 //------------------------------------------------------------------------------
 // ADC configurations
 
 #define ADC_NUM_CHANNELS   8
-#define ADC_BUF_DEPTH      1
+#define ADC_MAX_OVERSAMPLE 16 // 16 summed 12-bit codes still fit the 12.4 domain
+#define ADC_BUF_DEPTH      (2 * ADC_MAX_OVERSAMPLE) // circular, the callback gets one half
+
+static adcsample_t samples[ADC_NUM_CHANNELS * ADC_BUF_DEPTH]; // DMA target, SRAM
+CCM_RAM static adcsample_t samples_reindexed[ADC_NUM_CHANNELS]; // samples from ADC but reindexed for PCB routing correction, in 12.4 (see calib.h)
+
+static uint16_t channel_smp[ADC_NUM_CHANNELS]; // sample time, ADC clock cycles
+
+// every ADC callback gets 2^adc_oversample_log2 back-to-back sequences and sums them
+static uint8_t adc_oversample_log2 = 0;
+
+CCM_RAM static float channel_data[ADC_NUM_CHANNELS]; // filter state, ISR only
+
+// channel settings of ADC.txt (chN_en/zero/gain/filt/poly/pwl) and the kernel
+// coefficients derived from them
+typedef struct
+{
+  uint32_t version; // configs applied since boot, see write_config_record()
+  uint8_t en[ADC_NUM_CHANNELS];
+  float zero[ADC_NUM_CHANNELS];
+  float gain[ADC_NUM_CHANNELS];
+  float fltorder[ADC_NUM_CHANNELS];
+  calib_curve_t curve[ADC_NUM_CHANNELS]; // non-linear calibration, replaces zero/gain of the channel
+  
+  // derived, see update_channel_coefs()
+  const uint16_t *lut[ADC_NUM_CHANNELS]; // 0 = linear channel
+  uint8_t lut_slot[ADC_NUM_CHANNELS];    // calibration table number of lut
+  float flt_a[ADC_NUM_CHANNELS];
+  float flt_b[ADC_NUM_CHANNELS];
+  float eff_zero[ADC_NUM_CHANNELS]; // zero/gain actually applied, LUT range for calibrated channels
+  float eff_gain[ADC_NUM_CHANNELS];
+  float offset[ADC_NUM_CHANNELS];   // -zero*gain
+  uint8_t seed;                     // channels whose filter restarts with this config
+} channel_config_t;
 
-static adcsample_t samples[ADC_NUM_CHANNELS * ADC_BUF_DEPTH];
-static adcsample_t samples_reindexed[ADC_NUM_CHANNELS]; // samples from ADC but reindexed for PCB routing correction
+// double buffered: a new config is put together in the set not in use, the
+// ADC callback switches to it between two DMA blocks and the formatter
+// follows with the first record sampled under it (SAMPLE_CONFIG), so a
+// change never stops or tears the sampling (SRAM, they have to start zeroed)
+static channel_config_t channel_cfg[2];
+static channel_config_t * volatile cfg_isr = &channel_cfg[0];  // ADC callback, writer timer
+static channel_config_t * volatile cfg_pending = 0;             // taken over by the ADC callback
+static channel_config_t *cfg_fmt = &channel_cfg[0];             // formatter
+static volatile uint8_t cfg_switched = 0; // ADC callback -> writer timer, flags the next record
+static uint32_t config_version = 0;
 
-static uint8_t channel_en[ADC_NUM_CHANNELS];
+// ADC input of a channel in the 12.4 domain from the sum of its oversampled
+// codes, through its calibration table (at the averaged code) if it has one
+#define CHANNEL_INPUT(cc, ch, sum, os_log2) \
+  ((cc)->lut[ch] ? CALIB_LOOKUP((cc)->lut[ch], ((sum) >> (os_log2)) & ((1 << CALIB_CODE_BITS) - 1)) \
+                 : (adcsample_t)((sum) << (CALIB_FRAC_BITS - (os_log2))))
+
+static void channel_config_defaults(channel_config_t *cc)
+{
+  int i;
+  
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+  {
+    cc->en[i] = 0; // all channels disabled by default
+    cc->zero[i] = 0;
+    cc->gain[i] = 1;
+    cc->fltorder[i] = 1;
+    cc->curve[i].kind = CALIB_NONE;
+  }
+}
 
-static float channel_zero[ADC_NUM_CHANNELS];
-static float channel_gain[ADC_NUM_CHANNELS];
+// a chN_en/zero/gain/filt/poly/pwl line of ADC.txt into cc, returns 0 for
+// any other line
+static int channel_config_line(channel_config_t *cc, const char *pLine, const char *name, float value)
+{
+  char key[16];
+  int ch;
+  
+  if (sscanf(name, "ch%d_%15s", &ch, key) != 2 || ch < 1 || ch > ADC_NUM_CHANNELS)
+    return 0;
+  ch--;
+  
+  if (strcmp(key, "en") == 0)
+    cc->en[ch] = (int)value;
+  else
+  if (strcmp(key, "zero") == 0)
+    cc->zero[ch] = value;
+  else
+  if (strcmp(key, "gain") == 0)
+    cc->gain[ch] = value;
+  else
+  if (strcmp(key, "filt") == 0)
+    cc->fltorder[ch] = value;
+  else
+  // chN_poly c0 c1 c2 c3  or  chN_pwl x0 y0 x1 y1 ... (x = raw ADC code)
+  if (strcmp(key, "poly") == 0 || strcmp(key, "pwl") == 0)
+    calib_parse(&cc->curve[ch], strcmp(key, "poly") == 0 ? CALIB_POLY : CALIB_PWL,
+                strstr(pLine, name) + strlen(name));
+  else
+    return 0; // chN_smp
+  
+  return 1;
+}
 
-static float channel_data[ADC_NUM_CHANNELS];
-static float channel_fltorder[ADC_NUM_CHANNELS];
+// must be called after any change of the settings in cc; live is the config
+// in use or 0: its calibration tables are shared where the curve is the same,
+// new tables go into the ones it does not use; returns the number of
+// calibrated channels left linear because no table was free
+static int update_channel_coefs(channel_config_t *cc, const channel_config_t *live)
+{
+  const uint16_t *lut;
+  uint32_t used = 0;
+  int missing = 0;
+  int i;
+  int slot;
+  
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+    if (live && live->lut[i]) used |= 1 << live->lut_slot[i];
+  cc->seed = 0;
+  
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+  {
+    cc->lut[i] = 0; // linear until the table is rebuilt
+    cc->eff_zero[i] = cc->zero[i];
+    cc->eff_gain[i] = cc->gain[i];
+    
+    if (cc->en[i] && cc->curve[i].kind != CALIB_NONE)
+    {
+      if (live && live->lut[i] && calib_same(&cc->curve[i], &live->curve[i]))
+      {
+        cc->lut[i] = live->lut[i];
+        cc->lut_slot[i] = live->lut_slot[i];
+        cc->eff_zero[i] = live->eff_zero[i];
+        cc->eff_gain[i] = live->eff_gain[i];
+      }
+      else
+      {
+        for (slot = 0; slot < CALIB_LUT_COUNT && (used & (1 << slot)); slot++);
+        if (slot == CALIB_LUT_COUNT)
+          missing++;
+        lut = calib_build_lut(slot, &cc->curve[i], &cc->eff_zero[i], &cc->eff_gain[i]);
+        if (lut)
+        {
+          cc->lut[i] = lut;
+          cc->lut_slot[i] = slot;
+          used |= 1 << slot;
+        }
+        else
+        {
+          cc->eff_zero[i] = cc->zero[i];
+          cc->eff_gain[i] = cc->gain[i];
+        }
+      }
+    }
+    
+    // a channel just enabled or with another table starts its filter anew
+    if (live && cc->en[i] && (!live->en[i] || cc->lut[i] != live->lut[i]))
+      cc->seed |= 1 << i;
+    
+    // the filter input is in 12.4, its state stays in ADC codes
+    chan_filter_coefs(cc->fltorder[i], cc->en[i], &cc->flt_a[i], &cc->flt_b[i]);
+    cc->flt_b[i] *= 1.0f / (1 << CALIB_FRAC_BITS);
+    cc->offset[i] = -cc->eff_zero[i] * cc->eff_gain[i];
+  }
+  
+  return missing;
+}
 //------------------------------------------------------------------------------
 
+/*===========================================================================*/
+// sample queue: the writer timer ISR only takes a snapshot of the filtered
+// channels, the formatter thread converts them to text later
+
+#define SAMPLE_QUEUE_DEPTH  256 // records, must be power of 2
+
+#define SAMPLE_TRIGGER      0x01 // first record after the trigger condition was met
+#define SAMPLE_CONFIG       0x02 // first record sampled with a new channel config
+
+typedef struct
+{
+  uint64_t stamp; // timebase microseconds
+  float data[ADC_NUM_CHANNELS];
+  uint32_t flags; // SAMPLE_xxx
+} sample_record_t;
+
+CCM_RAM static sample_record_t sample_queue[SAMPLE_QUEUE_DEPTH];
+static volatile uint32_t sample_queue_head = 0; // written by ISR only
+static volatile uint32_t sample_queue_tail = 0; // written by formatter only
+static BinarySemaphore sample_queue_sem;
+
+uint32_t sample_queue_drops = 0; // records lost because formatter fell behind
+
+// stage peaks for the console "stats" command, since boot or "stats clear"
+uint32_t sample_queue_peak = 0; // formatter: most records waiting at a wake-up
+uint32_t fmt_record_peak = 0;   // formatter: most DWT cycles spent on one record
+uint32_t write_waits = 0;       // formatter: waited for the writer to free its buffer
+systime_t write_peak = 0;       // writer: longest write + sync of a buffer, ticks
+
+/*===========================================================================*/
+// triggered capture: the ADC callback evaluates the trigger condition on the
+// filtered, calibrated value of one channel, the formatter keeps the last
+// trig_pre records in a ring and writes only them plus trig_post records
+// after each trigger, then re-arms
+
+#define TRIG_OFF      0 // continuous logging
+#define TRIG_RISE     1 // crossing trig_level upwards
+#define TRIG_FALL     2 // crossing trig_level downwards
+#define TRIG_ABOVE    3 // value > trig_level
+#define TRIG_BELOW    4 // value < trig_level
+#define TRIG_WINDOW   5 // value leaves [trig_level, trig_level2]
+
+#define TRIG_PRE_MAX  256 // records, must be power of 2
+
+static uint8_t trig_mode = TRIG_OFF;
+static uint8_t trig_ch = 0;
+static float trig_level = 0;
+static float trig_level2 = 0;
+static uint32_t trig_pre = 0;
+static uint32_t trig_post = 0;
+
+static volatile uint8_t trig_armed = 0; // set by formatter, cleared by ADC callback when it fires
+static volatile uint8_t trig_fired = 0; // ADC callback -> writer timer, flags the next record
+static float trig_prev;                 // ADC callback only, for the edge modes
+
+// history before the trigger, formatter only (12 KB of CCM)
+CCM_RAM static sample_record_t trig_ring[TRIG_PRE_MAX];
+static uint32_t trig_ring_count = 0;
+static uint32_t trig_post_left = 0; // records of the running capture still to write
+
+/*===========================================================================*/
+// analog watchdog capture (awd_window > 0): between events only the ADC runs,
+// converting without DMA, and nothing but its watchdog can interrupt; an
+// event restarts normal sampling and logging for awd_window ms
+
+static uint8_t awd_ch = 0;            // 0 = all channels, else ch #N
+static uint16_t awd_low = 0;          // raw ADC codes, the event is a value outside [low, high]
+static uint16_t awd_high = 4095;
+static uint32_t awd_window = 0;       // ms, 0 = mode off
+static volatile uint8_t awd_event = 0; // set by the ADC error callback
+static uint8_t awd_capturing = 0;     // main loop only
+static systime_t stAwdCaptureStart;
+
+#define CHANNEL_SEED_ALL 0xFF
+static volatile uint8_t channel_seed = 0; // next ADC block initializes the filter state of these channels
+
+// called from the ADC callback after the filter step, under lock
+static void trig_checkI()
+{
+  float v = channel_data[trig_ch] * cfg_isr->eff_gain[trig_ch] + cfg_isr->offset[trig_ch];
+  int hit;
+  
+  switch (trig_mode)
+  {
+    case TRIG_RISE:   hit = trig_prev < trig_level && v >= trig_level; break;
+    case TRIG_FALL:   hit = trig_prev > trig_level && v <= trig_level; break;
+    case TRIG_ABOVE:  hit = v > trig_level; break;
+    case TRIG_BELOW:  hit = v < trig_level; break;
+    case TRIG_WINDOW: hit = v < trig_level || v > trig_level2; break;
+    default:          hit = 0; break;
+  }
+  trig_prev = v;
+  
+  if (hit && trig_armed)
+  {
+    trig_armed = 0;
+    trig_fired = 1;
+  }
+}
+
 /*===========================================================================*/
 // data bufferization functions
 
-#define SD_WRITE_BUFFER             (1024*49)//(1024*21)   // 21K
-#define SD_WRITE_BUFFER_FLUSH_LIMIT (1024*48)//(1024*20)   // 20K
+// two of them take most of the 128K of SRAM, the rest is left to the FatFs
+// objects and the smaller buffers of the other modules
+#define SD_WRITE_BUFFER             (1024*51)//(1024*21)   // 21K
+#define SD_WRITE_BUFFER_FLUSH_LIMIT (1024*50)//(1024*20)   // 20K
 
 #include <string.h>
 #include "mmcsd.h"
 
-// buffer for collecting data to write
+// buffer for collecting data to write (SRAM, both buffers are handed to the SDIO DMA)
 char sd_buffer[SD_WRITE_BUFFER];
 WORD sd_buffer_length = 0;
 
 // buffer for storing ready to write data
 char sd_buffer_for_write[SD_WRITE_BUFFER];
-unsigned char bReqWrite = 0; // write request, the sd_buffer is being copied to sd_buffer_for_write 
+volatile unsigned char bReqWrite = 0; // write request, the sd_buffer is being copied to sd_buffer_for_write (formatter -> main loop)
 WORD sd_buffer_length_for_write = 0;
 
-unsigned char bWriteFault = 0; // in case of overlap or write fault
+unsigned char bWriteFault = 0; // 1 - samples lost, 2 - write fault
+
+// working state of the output modes; only the one of output_mode is used
+// while logging, so they share their CCM
+CCM_RAM static union
+{
+  struct
+  {
+    vlog_frame_t frame;
+    vlog_index_t index;
+  } bin;                                     // OUTPUT_BIN, see bin_start_log()
+  uint16_t lz4_hash[1 << LZ4_HASH_LOG];      // OUTPUT_LZ4
+} out_state;
+
+#define OUTPUT_CSV  0 // text, one line per sample
+#define OUTPUT_BIN  1 // delta/varint compressed frames, see vlog_format.h
+#define OUTPUT_LZ4  2 // CSV text, every flush buffer compressed to one LZ4 frame
+unsigned char output_mode = OUTPUT_CSV;
+
+DWORD log_file_offset = 0; // file position of sd_buffer[0]
 
 
 // fill buffer with spaces (before \r\n) to make it 512 byte size
@@ -82,6 +370,20 @@ int align_buffer()
   int i;
   int len;
   
+  // compressed logs are padded after compression, see copy_buffer()
+  if (output_mode == OUTPUT_LZ4) return 1;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    // binary logs are padded with a record readers skip
+    len = (MMCSD_BLOCK_SIZE - sd_buffer_length % MMCSD_BLOCK_SIZE) % MMCSD_BLOCK_SIZE;
+    if (len == 0) return 1;
+    if (len < VLOG_REC_HEADER_SIZE) len += MMCSD_BLOCK_SIZE;
+    
+    sd_buffer_length += vlog_put_pad((uint8_t *)&sd_buffer[sd_buffer_length], len);
+    return 1;
+  }
+  
   if (sd_buffer_length < 2) return 0;
   if (sd_buffer[sd_buffer_length-2] != '\r') return 0;
   if (sd_buffer[sd_buffer_length-1] != '\n') return 0;
@@ -101,32 +403,102 @@ int align_buffer()
 // copy input buffer into the buffer for flash writing data
 void copy_buffer()
 {
-  // request write operation
-  memcpy(sd_buffer_for_write, sd_buffer, sd_buffer_length);
-  sd_buffer_length_for_write = sd_buffer_length;
+  WORD len;
+  
+  if (output_mode == OUTPUT_LZ4)
+  {
+    // compress instead of copy, the frame is padded to the sector size with
+    // a skippable frame; 48K of CSV compresses in a few ms, well below the
+    // time the card needs for the bytes saved (see lz4_last_cycles)
+    len = lz4_frame((uint8_t *)sd_buffer, sd_buffer_length, (uint8_t *)sd_buffer_for_write, SD_WRITE_BUFFER,
+                    out_state.lz4_hash);
+    sd_buffer_length_for_write = len;
+    
+    len = (MMCSD_BLOCK_SIZE - len % MMCSD_BLOCK_SIZE) % MMCSD_BLOCK_SIZE;
+    if (len > 0 && len < LZ4_SKIPPABLE_MIN) len += MMCSD_BLOCK_SIZE;
+    if (len > 0)
+      sd_buffer_length_for_write += lz4_put_skippable((uint8_t *)&sd_buffer_for_write[sd_buffer_length_for_write], len);
+  }
+  else
+  {
+    // request write operation
+    memcpy(sd_buffer_for_write, sd_buffer, sd_buffer_length);
+    sd_buffer_length_for_write = sd_buffer_length;
+  }
+  
+  log_file_offset += sd_buffer_length_for_write;
   sd_buffer_length = 0;
 }
 
+// signalled by the writer (main loop) every time sd_buffer_for_write is free again
+static BinarySemaphore write_done_sem;
+
+// log segments: the buffer handed over after seg_end_pending is set is the last one of
+// the current file, the writer switches files (or closes the log) after writing it
+#define SEG_END_NONE    0
+#define SEG_END_ROTATE  1 // continue in the next file
+#define SEG_END_CLOSE   2 // log stopped
+unsigned char seg_end_pending = SEG_END_NONE; // formatter side
+uint32_t seg_pending_first_sample;            // first sample of the next segment
+uint64_t seg_pending_first_us;                // ... and its time since log start
+unsigned char seg_end_write = SEG_END_NONE;   // writer side, for sd_buffer_for_write
+uint32_t seg_write_first_sample;
+uint64_t seg_write_first_us;
+
+// sidecar time index (.idx, see vlog_format.h): the formatter notes an entry
+// every index_every records, the entries travel with the buffer holding the
+// records and the writer appends them to the index after the data
+#define IDX_BUF_ENTRIES 32
+uint32_t index_every = 1000; // 0 - no index
+uint8_t idx_buf[IDX_BUF_ENTRIES * VLOG_IDX_ENTRY_SIZE];
+WORD idx_buf_length = 0;
+uint8_t idx_buf_for_write[IDX_BUF_ENTRIES * VLOG_IDX_ENTRY_SIZE];
+WORD idx_buf_length_for_write = 0;
+uint32_t idx_next_sample; // records before this one get no entry
+
 void request_write()
 {
   if (bReqWrite)
-    bWriteFault = 1; // buffer overlapping
+  {
+    write_waits++;
+    
+    // card is slower than we produce data -- hold on until the previous
+    // buffer is written, the sample queue absorbs the samples meanwhile
+    while (bReqWrite)
+      chBSemWaitTimeout(&write_done_sem, MS2ST(10));
+  }
   
   // request write operation
   align_buffer();
   copy_buffer();
+  seg_end_write = seg_end_pending;
+  seg_write_first_sample = seg_pending_first_sample;
+  seg_write_first_us = seg_pending_first_us;
+  seg_end_pending = SEG_END_NONE;
+  memcpy(idx_buf_for_write, idx_buf, idx_buf_length);
+  idx_buf_length_for_write = idx_buf_length;
+  idx_buf_length = 0;
   bReqWrite = 1;
+  chEvtSignal(main_tp, EVT_WRITE);
 }
 
 int iLastWriteSecond = 0;
 static struct tm timp;
   
-void fwrite_string(char *pString)
+// make room for length bytes in sd_buffer, returns where to put them;
+// the buffer never grows past the flush limit, so there is always room left
+// for the alignment padding
+char *fbuffer_reserve(WORD length)
 {
-  WORD length = strlen(pString);
+  if (sd_buffer_length + length > SD_WRITE_BUFFER_FLUSH_LIMIT)
+    request_write();
+  
+  return &sd_buffer[sd_buffer_length];
+}
 
-  // Add string
-  memcpy(&sd_buffer[sd_buffer_length], pString, length);
+// add length bytes put at fbuffer_reserve() to the buffer
+void fbuffer_commit(WORD length)
+{
   sd_buffer_length += length;
   
   // Check flush limit
@@ -136,365 +508,1824 @@ void fwrite_string(char *pString)
   }
 }
 
+// file position where the next byte added to the buffer will be written
+DWORD fbuffer_offset()
+{
+  return log_file_offset + sd_buffer_length;
+}
+
+// record sample at file position offset, time_us since the log start
+void index_note(uint32_t sample, uint64_t time_us, DWORD offset)
+{
+  if (index_every == 0 || output_mode == OUTPUT_LZ4) return;
+  if (sample < idx_next_sample) return;
+  if (idx_buf_length + VLOG_IDX_ENTRY_SIZE > sizeof(idx_buf)) return; // the index just gets coarser
+  
+  idx_buf_length += vlog_put_idx_entry(&idx_buf[idx_buf_length], sample, offset, time_us);
+  idx_next_sample = sample + index_every;
+}
+
+void fwrite_string(char *pString)
+{
+  WORD length = strlen(pString);
+
+  // Add string
+  memcpy(fbuffer_reserve(length), pString, length);
+  fbuffer_commit(length);
+}
+
 
 
 
 
 // file writing 
 FATFS SDC_FS;
-FIL *file;
+file_t *file;
 FRESULT fres;
+unsigned char bFreeScanDone; // free cluster map of the mounted card is complete
+#define FREE_SCAN_STEP  16   // FAT sectors scanned per written buffer
+
+// log rotation: a new file after rotate_bytes or rotate_period seconds, 0 - off
+DWORD rotate_bytes = 0;
+int rotate_period = 0;
+#define ROTATE_PREALLOC_STEP  (1024UL*1024)       // allocated to the next file per write
+#define ROTATE_PREALLOC_MAX   (1024UL*1024*1024)  // well below the FAT32 file size limit
+file_t *file_next;         // next segment, created and allocated before the switch
+file_t *file_list;         // HH-MM-SS.lst
+file_t *file_idx;          // index of the segment being written, 0 - none
+DWORD file_next_alloc;     // bytes allocated to it so far
+unsigned char bNextFault;  // the next file could not be created or extended
+char sLogBase[16];         // HH-MM-SS of the log start, segments add _NNN
+const char *sLogExt;
+int seg_number;            // segment being written, 0 - the first one
+uint32_t seg_first_sample; // first sample of the segment being written
+uint64_t seg_first_us;     // ... and its time since log start
+systime_t stSegStart;      // formatter: when the current segment was started
+systime_t stSegWriteStart; // writer: when the card got the first buffer of it
 
 int i;
 
 #define STRLINE_LENGTH 1024
 char sLine[STRLINE_LENGTH];
 systime_t stLastWriting;
-unsigned char bIncludeTimestamp = 1;
+unsigned char bIncludeTimestamp = 1; // 0 - none, 1 - us since log start, 2 - us since previous row
+uint64_t log_start_us; // timebase value when the log was started
+uint64_t last_stamp_us; // timestamp of the previous row, for delta encoding
 char sTmp[128];
 char format_str[128];
+uint32_t sample_period_us; // writer timer period
+uint32_t sample_counter; // samples written to the current log
 
-void start_log()
+unsigned char bReqFlush = 0; // main loop asks the formatter to flush sd_buffer
+unsigned char bReqClose = 0; // ... and to finish the log file before that
+
+int rtc_sync_period = 10; // seconds between (RTC, timebase) pairs in the log, 0 - only at start
+systime_t stLastRtcSync;
+
+// unsigned 64-bit to decimal, returns number of characters written
+static int format_u64(char *dst, uint64_t value)
 {
-  // open file and write the begining of the load
-  rtcGetTimeTm(&RTCD1, &timp);        
-  sprintf(sLine, "%02d-%02d-%02d.csv", timp.tm_hour, timp.tm_min, timp.tm_sec); // making new file
+  char tmp[20];
+  int n = 0;
+  int len;
+  
+  do
+  {
+    tmp[n++] = '0' + (char)(value % 10);
+    value /= 10;
+  } while (value);
+  
+  len = n;
+  while (n)
+    *dst++ = tmp[--n];
+  *dst = 0;
+  
+  return len;
+}
 
-  file = fopen_(sLine, "a");
+// writes "#rtc,<RTC unix time, us>,<timebase us since log start>" so the host
+// can convert sample times to UTC and correct the drift between both clocks
+void write_rtc_sync(char *pLine)
+{
+  uint64_t t0, t1, rtc_us;
+  char *p = pLine;
   
-  // write header line
-  sLine[0] = 0;
-  if (bIncludeTimestamp)
-    strcpy(sLine, "Timestamp");
+  // RTC read is bracketed by two timebase reads, take the middle
+  t0 = timebase_now();
+  rtc_us = rtcGetTimeUnixUsec(&RTCD1);
+  t1 = timebase_now();
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    fbuffer_commit(vlog_put_rtc((uint8_t *)fbuffer_reserve(VLOG_REC_HEADER_SIZE + 16),
+                                rtc_us, t0 + (t1 - t0) / 2 - log_start_us));
+  }
+  else
+  {
+    strcpy(p, "#rtc,");
+    p += 5;
+    p += format_u64(p, rtc_us);
+    *p++ = ',';
+    p += format_u64(p, t0 + (t1 - t0) / 2 - log_start_us);
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+  
+  stLastRtcSync = chTimeNow();
+}
+
+// writes "#trigger,<timebase us since log start>" before every triggered capture
+void write_trigger_mark(char *pLine, uint64_t stamp)
+{
+  char *p = pLine;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    fbuffer_commit(vlog_put_trigger((uint8_t *)fbuffer_reserve(VLOG_REC_HEADER_SIZE + 8),
+                                    stamp - log_start_us));
+  }
+  else
+  {
+    strcpy(p, "#trigger,");
+    p += 9;
+    p += format_u64(p, stamp - log_start_us);
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+}
+
+// writes "#config,<timebase us since log start>,<version>" and the zero, gain
+// and filter order actually applied for every enabled channel from stamp on
+void write_config_record(char *pLine, uint64_t stamp)
+{
+  char *p = pLine;
+  uint8_t mask = 0;
+  int i;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    for (i = 0; i < ADC_NUM_CHANNELS; i++)
+      if (cfg_fmt->en[i]) mask |= 1 << i;
+    fbuffer_commit(vlog_put_config((uint8_t *)fbuffer_reserve(VLOG_REC_CONFIG_MAX_SIZE), stamp - log_start_us,
+                                   cfg_fmt->version, mask, cfg_fmt->eff_zero, cfg_fmt->eff_gain,
+                                   cfg_fmt->fltorder));
+  }
+  else
+  {
+    strcpy(p, "#config,");
+    p += 8;
+    p += format_u64(p, stamp - log_start_us);
+    p += sprintf(p, ",%lu", (unsigned long)cfg_fmt->version);
+    for (i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+      if (cfg_fmt->en[i])
+        p += sprintf(p, ",%g,%g,%g", cfg_fmt->eff_zero[i], cfg_fmt->eff_gain[i], cfg_fmt->fltorder[i]);
+    }
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+}
+
+
+static const char hex_digit[] = "0123456789ABCDEF";
+
+// writes "#can,<timebase us since log start>,<bus>,<id>,<dlc>,<data>" for a
+// received CAN frame; id and data in hex like candump: 3 digits for standard,
+// 8 for extended identifiers, R instead of the data for remote frames
+void write_can_frame(char *pLine, const can_record_t *f)
+{
+  char *p = pLine;
+  int k;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    fbuffer_commit(vlog_put_can((uint8_t *)fbuffer_reserve(VLOG_REC_CAN_MAX_SIZE), f->stamp - log_start_us,
+                                f->id | ((f->flags & CAN_FRAME_EXT) ? VLOG_CAN_EXT : 0) |
+                                ((f->flags & CAN_FRAME_RTR) ? VLOG_CAN_RTR : 0),
+                                f->bus + 1, f->dlc, f->data));
+  }
+  else
+  {
+    strcpy(p, "#can,");
+    p += 5;
+    p += format_u64(p, f->stamp - log_start_us);
+    *p++ = ',';
+    *p++ = '1' + f->bus;
+    *p++ = ',';
+    for (k = (f->flags & CAN_FRAME_EXT) ? 28 : 8; k >= 0; k -= 4)
+      *p++ = hex_digit[(f->id >> k) & 0xF];
+    *p++ = ',';
+    *p++ = '0' + (f->dlc > 8 ? 8 : f->dlc);
+    *p++ = ',';
+    if (f->flags & CAN_FRAME_RTR)
+      *p++ = 'R';
+    else
+    {
+      for (k = 0; k < f->dlc && k < 8; k++)
+      {
+        *p++ = hex_digit[f->data[k] >> 4];
+        *p++ = hex_digit[f->data[k] & 0xF];
+      }
+    }
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+}
+
+
+// writes a received serial frame: "#ser,<timebase us since log start>,<usart>,<text>"
+// for a text line, bytes that are not printable ASCII and '\\' as \xHH, or
+// "#serb,<timebase us since log start>,<usart>,<bytes in hex>" for binary frames
+void write_ser_frame(char *pLine, const ser_record_t *f)
+{
+  char *p = pLine;
+  int k;
+  uint8_t b;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    fbuffer_commit(vlog_put_serial((uint8_t *)fbuffer_reserve(VLOG_REC_SERIAL_MAX_SIZE), f->stamp - log_start_us,
+                                   f->port, f->mode, f->length, f->data));
+  }
+  else
+  {
+    strcpy(p, f->mode == SER_FRAME_LINE ? "#ser," : "#serb,");
+    p += strlen(p);
+    p += format_u64(p, f->stamp - log_start_us);
+    *p++ = ',';
+    *p++ = '0' + f->port;
+    *p++ = ',';
+    for (k = 0; k < f->length; k++)
+    {
+      b = f->data[k];
+      if (f->mode == SER_FRAME_LINE && b >= 0x20 && b < 0x7F && b != '\\')
+        *p++ = b;
+      else
+      {
+        if (f->mode == SER_FRAME_LINE)
+        {
+          *p++ = '\\';
+          *p++ = 'x';
+        }
+        *p++ = hex_digit[b >> 4];
+        *p++ = hex_digit[b & 0xF];
+      }
+    }
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+}
+
+// writes "#gps,<UTC unix time, us>,<timebase us since log start>", the GPS
+// counterpart of write_rtc_sync(), for every RMC sentence of a valid fix
+void write_gps_sync(char *pLine, uint64_t utc_us, uint64_t stamp)
+{
+  char *p = pLine;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    fbuffer_commit(vlog_put_gps((uint8_t *)fbuffer_reserve(VLOG_REC_HEADER_SIZE + 16),
+                                utc_us, stamp - log_start_us));
+  }
+  else
+  {
+    strcpy(p, "#gps,");
+    p += 5;
+    p += format_u64(p, utc_us);
+    *p++ = ',';
+    p += format_u64(p, stamp - log_start_us);
+    strcpy(p, "\r\n");
+    
+    fwrite_string(pLine);
+  }
+}
+
+
+/*===========================================================================*/
+// binary output, the formatter thread owns all of this while logging
+
+static uint32_t bin_frame_first_sample;
+static uint64_t bin_frame_first_us;
+
+static void bin_start_log()
+{
+  uint8_t mask = 0;
+  uint8_t channels = 0;
   
   for (i = 0; i < ADC_NUM_CHANNELS; i++)
   {
-    if (channel_en[i])
+    if (cfg_fmt->en[i])
     {
-      sprintf(sTmp, ",ch #%d", i+1);
-      strcat(sLine, sTmp);
+      mask |= 1 << i;
+      channels++;
     }
   }
-  strcat(sLine, "\r\n");
+  
+  vlog_frame_init(&out_state.bin.frame, channels, sample_period_us);
+  vlog_index_init(&out_state.bin.index);
+  
+  fbuffer_commit(vlog_put_header((uint8_t *)fbuffer_reserve(256), mask, sample_period_us,
+                                 cfg_fmt->eff_zero, cfg_fmt->eff_gain, cfg_fmt->fltorder));
+  
+  // curves of the calibrated channels, for reference, the header already has their effective zero/gain
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+  {
+    if (cfg_fmt->lut[i])
+      fbuffer_commit(vlog_put_calib((uint8_t *)fbuffer_reserve(VLOG_REC_CALIB_MAX_SIZE), i,
+                                    cfg_fmt->curve[i].kind, cfg_fmt->curve[i].count, cfg_fmt->curve[i].p));
+  }
+}
+
+// moves the current (maybe partial) frame into the write buffer
+static void bin_flush_frame()
+{
+  WORD length = vlog_frame_close(&out_state.bin.frame);
+  char *p;
+  
+  if (length == 0) return;
+  
+  p = fbuffer_reserve(length);
+  vlog_index_add(&out_state.bin.index, bin_frame_first_sample, fbuffer_offset());
+  index_note(bin_frame_first_sample, bin_frame_first_us, fbuffer_offset());
+  memcpy(p, out_state.bin.frame.buf, length);
+  fbuffer_commit(length);
+}
+
+static void bin_add_record(const sample_record_t *rec)
+{
+  uint16_t values[ADC_NUM_CHANNELS];
+  int i;
+  int n = 0;
+  
+  // 12.4 fixed point of the filtered ADC code
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+  {
+    if (cfg_fmt->en[i])
+      values[n++] = (uint16_t)(rec->data[i] * (1 << VLOG_VALUE_FRAC_BITS) + 0.5f);
+  }
+  
+  if (out_state.bin.frame.count == 0)
+  {
+    bin_frame_first_sample = sample_counter;
+    bin_frame_first_us = rec->stamp - log_start_us;
+  }
+  
+  vlog_frame_add(&out_state.bin.frame, sample_counter, rec->stamp - log_start_us, values);
+  
+  if (out_state.bin.frame.count == VLOG_FRAME_SAMPLES)
+    bin_flush_frame();
+}
+
+// writes the frame index and the end record, which finishes exactly on a sector boundary
+static void bin_close_log()
+{
+  DWORD index_offset;
+  WORD pad;
+  char *p;
+  
+  bin_flush_frame();
+  
+  p = fbuffer_reserve(VLOG_REC_HEADER_SIZE + 4 + VLOG_INDEX_MAX * 8);
+  index_offset = fbuffer_offset();
+  fbuffer_commit(vlog_put_index((uint8_t *)p, &out_state.bin.index));
+  
+  p = fbuffer_reserve(MMCSD_BLOCK_SIZE + VLOG_REC_HEADER_SIZE + VLOG_REC_END_SIZE);
+  pad = (MMCSD_BLOCK_SIZE - (sd_buffer_length + VLOG_REC_END_SIZE) % MMCSD_BLOCK_SIZE) % MMCSD_BLOCK_SIZE;
+  if (pad > 0 && pad < VLOG_REC_HEADER_SIZE) pad += MMCSD_BLOCK_SIZE;
+  if (pad > 0)
+    vlog_put_pad((uint8_t *)p, pad);
+  vlog_put_end((uint8_t *)p + pad, index_offset);
+  fbuffer_commit(pad + VLOG_REC_END_SIZE);
+}
+
+// puts the beginning of a log file into the buffer: the binary header or the
+// CSV column names, then an absolute time anchor; every segment gets one
+void write_log_header(char *pLine, char *pTmp)
+{
+  int k;
+  
+  if (output_mode == OUTPUT_BIN)
+  {
+    bin_start_log();
+  }
+  else
+  {
+    // write header line
+    pLine[0] = 0;
+    if (bIncludeTimestamp == 2)
+      strcpy(pLine, "dt_us");
+    else
+    if (bIncludeTimestamp)
+      strcpy(pLine, "Timestamp_us");
+    
+    for (k = 0; k < ADC_NUM_CHANNELS; k++)
+    {
+      if (cfg_fmt->en[k])
+      {
+        sprintf(pTmp, ",ch #%d", k+1);
+        strcat(pLine, pTmp);
+      }
+    }
+    strcat(pLine, "\r\n");
+
+    fwrite_string(pLine);
+  }
+  
+  write_rtc_sync(pLine);
+}
+
+// segment n of the current log, the first one has no number
+void log_segment_name(char *pName, int n)
+{
+  if (n == 0)
+    sprintf(pName, "%s.%s", sLogBase, sLogExt);
+  else
+    sprintf(pName, "%s_%03d.%s", sLogBase, n, sLogExt);
+}
+
+// appends the entries that came with the buffer just written
+void log_index_write()
+{
+  if (file_idx && idx_buf_length_for_write > 0)
+  {
+    if (fwrite_(idx_buf_for_write, 1, idx_buf_length_for_write, file_idx) != idx_buf_length_for_write ||
+        fsync_(file_idx) != 0)
+    {
+      // a broken index is no reason to stop the log, drop it
+      fclose_(file_idx);
+      file_idx = 0;
+    }
+  }
+  idx_buf_length_for_write = 0;
+}
+
+// opens the index of segment n and writes its header
+void log_index_open(int n)
+{
+  file_idx = 0;
+  if (index_every == 0 || output_mode == OUTPUT_LZ4) return;
+  
+  if (n == 0)
+    sprintf(sLine, "%s.idx", sLogBase);
+  else
+    sprintf(sLine, "%s_%03d.idx", sLogBase, n);
+  file_idx = fopen_(sLine, "w");
+  if (file_idx == 0) return; // the log goes on without it
+  
+  // nothing is waiting in idx_buf_for_write here
+  idx_buf_length_for_write = vlog_put_idx_header(idx_buf_for_write, index_every);
+  log_index_write();
+}
+
+void start_log()
+{
+  // open file and write the begining of the load
+  rtcGetTimeTm(&RTCD1, &timp);        
+  sprintf(sLogBase, "%02d-%02d-%02d", timp.tm_hour, timp.tm_min, timp.tm_sec);
+  sLogExt = output_mode == OUTPUT_BIN ? "vlb" : (output_mode == OUTPUT_LZ4 ? "csv.lz4" : "csv");
+  log_segment_name(sLine, 0); // making new file
+
+  file = fcreate_(sLine);
+  
+  log_start_us = timebase_now();
+  last_stamp_us = log_start_us;
+  sample_counter = 0;
+  log_file_offset = 0;
+  
+  file_next = 0;
+  file_list = 0;
+  file_next_alloc = 0;
+  bNextFault = 0;
+  seg_number = 0;
+  seg_first_sample = 0;
+  seg_first_us = 0;
+  seg_end_pending = SEG_END_NONE;
+  idx_buf_length = 0;
+  idx_next_sample = 0;
+  
+  write_log_header(sLine, sTmp);
+  align_buffer();
+  copy_buffer();
+  fwrite_(sd_buffer_for_write, 1, sd_buffer_length_for_write, file);
+  fsync_(file);
+
+  // reset buffer counters
+  sd_buffer_length_for_write = 0;
+  sd_buffer_length = 0;
+  
+  log_index_open(0);
+
+  bWriteFault = 0;
+
+  stLastWriting = chTimeNow(); // record time when we did write
+  stSegStart = stLastWriting;
+  stSegWriteStart = stLastWriting;
+
+  trig_ring_count = 0;
+  trig_post_left = 0;
+  trig_fired = 0;
+  
+  bLogging = 1;
+  trig_armed = (trig_mode != TRIG_OFF);
+}
+
+// appends "<file>,<first sample>,<first sample us>,<bytes>" of a finished segment to
+// HH-MM-SS.lst, so the host can put the segments of a log back together
+// the list stays open until the log is stopped
+void log_list_add(DWORD size)
+{
+  if (file_list == 0)
+  {
+    sprintf(sLine, "%s.lst", sLogBase);
+    file_list = fopen_(sLine, "a");
+    if (file_list == 0)
+    {
+      bWriteFault = 2;
+      return;
+    }
+  }
+  
+  if (seg_number == 0)
+    fputs_("#segment,first_sample,first_us,bytes\r\n", file_list);
+  
+  log_segment_name(sTmp, seg_number);
+  sprintf(sLine, "%s,%lu,", sTmp, (unsigned long)seg_first_sample);
+  format_u64(sLine + strlen(sLine), seg_first_us);
+  sprintf(sLine + strlen(sLine), ",%lu\r\n", (unsigned long)size);
+  fputs_(sLine, file_list);
+  if (fsync_(file_list) != 0)
+    bWriteFault = 2;
+}
+
+// creates the next segment and allocates its clusters a step at a time, between
+// the writes, so the switch does not have to search the FAT for free space
+void log_prealloc_step()
+{
+  DWORD target;
+  DWORD elapsed;
+  
+  if (bNextFault) return;
+  
+  if (file_next == 0)
+  {
+    log_segment_name(sLine, seg_number + 1);
+    file_next = fopen_(sLine, "w");
+    file_next_alloc = 0;
+    if (file_next == 0)
+    {
+      bNextFault = 1;
+      return;
+    }
+  }
+  
+  target = rotate_bytes;
+  if (target == 0)
+  {
+    // rotation by time only, size the file from the data rate seen so far (+1/8)
+    elapsed = chTimeElapsedSince(stSegWriteStart);
+    if (elapsed < S2ST(1)) return;
+    target = (DWORD)((uint64_t)ftell_(file) * S2ST(rotate_period) / elapsed);
+    target += target / 8;
+  }
+  else
+    target += SD_WRITE_BUFFER; // the switch happens on a buffer boundary
+  if (target > ROTATE_PREALLOC_MAX)
+    target = ROTATE_PREALLOC_MAX;
+  
+  if (file_next_alloc >= target) return;
+  
+  target = (target - file_next_alloc > ROTATE_PREALLOC_STEP) ? file_next_alloc + ROTATE_PREALLOC_STEP : target;
+  if (fseek_(file_next, target) != 0 || fsync_(file_next) != 0)
+  {
+    bNextFault = 1;
+    return;
+  }
+  if (ftell_(file_next) < target)
+    bNextFault = 1; // card full, the rest is allocated while writing
+  file_next_alloc = ftell_(file_next);
+}
+
+// the last buffer of a segment is on the card: cut off the unused allocation,
+// list the segment and go on with the next file or finish the log
+void log_segment_end(unsigned char how)
+{
+  DWORD size = ftell_(file);
+  
+  if (ftruncate_(file) != 0)
+    bWriteFault = 2;
+  fclose_(file);
+  file = 0;
+  if (file_idx)
+  {
+    fclose_(file_idx);
+    file_idx = 0;
+  }
+  
+  // a change of the enabled channels also starts a new segment
+  if (rotate_bytes || rotate_period || how == SEG_END_ROTATE || seg_number > 0)
+    log_list_add(size);
+  
+  if (how == SEG_END_ROTATE)
+  {
+    if (file_next == 0)
+    {
+      // not prepared in time, create it now
+      log_segment_name(sLine, seg_number + 1);
+      file_next = fopen_(sLine, "w");
+    }
+    
+    file = file_next;
+    file_next = 0;
+    file_next_alloc = 0;
+    bNextFault = 0;
+    if (file == 0 || fseek_(file, 0) != 0)
+      bWriteFault = 2;
+    
+    seg_number++;
+    log_index_open(seg_number);
+    seg_first_sample = seg_write_first_sample;
+    seg_first_us = seg_write_first_us;
+    stSegWriteStart = chTimeNow();
+  }
+  else
+  {
+    // log stopped, the next segment is not needed any more
+    if (file_next)
+    {
+      fclose_(file_next);
+      file_next = 0;
+      log_segment_name(sLine, seg_number + 1);
+      f_unlink(sLine);
+    }
+    if (file_list)
+    {
+      fclose_(file_list);
+      file_list = 0;
+    }
+  }
+}
+
+
+
+static gptcnt_t gpt_writer_period; // writer timer ticks per sample
+
+// makes cc the channel config: at once when not logging, else the ADC
+// callback switches to it at the next block; returns 0 if a calibrated channel
+// got no table (there is one per channel in both configs, CALIB_LUT_COUNT):
+// a live change is not applied then, a config read for a log start is
+// applied but the log is not started
+static int config_apply(channel_config_t *cc)
+{
+  int missing;
+  
+  if (!bLogging)
+  {
+    // the tables are rebuilt from the first one on, the ADC callback may be
+    // reading them: the conversion is stopped, the callers restart it
+    adcStopConversion(&ADCD1);
+    missing = update_channel_coefs(cc, 0);
+    cc->version = ++config_version;
+    chSysLock();
+    cfg_isr = cc;
+    cfg_fmt = cc;
+    cfg_pending = 0;
+    cfg_switched = 0;
+    channel_seed = CHANNEL_SEED_ALL;
+    chSysUnlock();
+    return missing == 0;
+  }
+  
+  if (update_channel_coefs(cc, cfg_isr) != 0)
+    return 0;
+  cc->version = ++config_version;
+  cfg_pending = cc;
+  return 1;
+}
+
+// while logging: reads the channel settings of ADC.txt into the set not in
+// use and switches to them without stopping the sampling, the other keys
+// apply at the next log start; returns 0 if the previous change has not
+// reached the formatter yet or there is no ADC.txt, CFG_NO_TABLES if the
+// change needs more calibration tables than are free (it waits for the next
+// log start then)
+#define CFG_NO_TABLES (-1)
+static int config_reload_live()
+{
+  channel_config_t *cc = &channel_cfg[cfg_isr == &channel_cfg[0]];
+  file_t *src;
+  float value;
+  char name[64];
+  
+  if (cfg_pending || cfg_fmt != cfg_isr)
+    return 0;
+  
+  src = fopen_("ADC.txt", "r"); // file is the log here
+  if (src == 0)
+    return 0;
+  
+  channel_config_defaults(cc);
+  while (fgets_(sLine, STRLINE_LENGTH, src))
+  {
+    if (sscanf(sLine, "%63s %f", name, &value) == 2)
+      channel_config_line(cc, sLine, name, value);
+  }
+  fclose_(src);
+  
+  if (!config_apply(cc))
+    return CFG_NO_TABLES;
+  return 1;
+}
+
+int read_config_file()
+{
+  float value;
+  char name[64];
+  char svalue[64];
+  char key[16];
+  float sample_time;
+  int res = 0;
+  int ch;
+  int i;
+  channel_config_t *cc;
+  
+  cfg_pending = 0; // a live change the ADC callback has not taken yet is dropped
+  cc = &channel_cfg[cfg_isr == &channel_cfg[0]]; // the set not in use
+
+  bIncludeTimestamp = 1;
+  rtc_sync_period = 10;
+  output_mode = OUTPUT_CSV;
+  
+  channel_config_defaults(cc);
+  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_smp[i] = 480;
+  adc_oversample_log2 = 0;
+  trig_mode = TRIG_OFF;
+  trig_ch = 0;
+  awd_ch = 0;
+  awd_low = 0;
+  awd_high = 4095;
+  awd_window = 0;
+  trig_pre = 0;
+  trig_post = 0;
+  rotate_bytes = 0;
+  rotate_period = 0;
+  index_every = 1000;
+  can_capture_defaults();
+  ser_capture_defaults();
+  strcpy(format_str, "%f");
+  
+  // read file
+  file = fopen_("ADC.txt", "r");
+  if (file == 0) 
+  {
+    return 0;
+  }
+  
+  while( fgets_(sLine, STRLINE_LENGTH, file) )
+  {
+    if (sscanf(sLine, "%s %f", name, &value) < 2)
+    {
+      if (sscanf(sLine, "%s %s", name, svalue) < 2)
+      {
+        continue;
+      }        
+    }
+    
+    if (channel_config_line(cc, sLine, name, value))
+      continue;
+    
+    if (strcmp(name, "sample") == 0)
+    {
+      sample_time = value; 
+      res = 1; // at least we got sample time, config file accepted
+    }
+    else
+    if (strcmp(name, "timestamp")  == 0)
+    {
+      bIncludeTimestamp = value;
+    }
+    else
+    if (strcmp(name, "rtc_sync")  == 0)
+    {
+      rtc_sync_period = (int)value;
+    }
+    else
+    if (strcmp(name, "rotate_mb")  == 0)
+    {
+      // start a new file after this many megabytes
+      if (value > 4000) value = 4000;
+      rotate_bytes = value > 0 ? (DWORD)(value * 1048576.0f) : 0;
+    }
+    else
+    if (strcmp(name, "rotate_s")  == 0)
+    {
+      // ... or after this many seconds
+      rotate_period = value > 0 ? (int)value : 0;
+    }
+    else
+    if (strcmp(name, "index_every")  == 0)
+    {
+      // records between two entries of the time index, 0 - no index
+      index_every = value > 0 ? (uint32_t)value : 0;
+    }
+    else
+      
+    // chN_smp: sample time in ADC cycles (3..480)
+    if (sscanf(name, "ch%d_%15s", &ch, key) == 2 && ch >= 1 && ch <= ADC_NUM_CHANNELS &&
+        strcmp(key, "smp") == 0)
+      channel_smp[ch - 1] = (uint16_t)value;
+    else
+      
+    // oversample N: sum of N (1, 2, 4, 8, 16) back-to-back conversions per filter step
+    if (strcmp(name, "oversample")  == 0)
+    {
+      for (adc_oversample_log2 = 0; adc_oversample_log2 < 4; adc_oversample_log2++)
+        if ((2 << adc_oversample_log2) > value) break;
+    }
+    else
+      
+    // triggered capture, see trig_checkI()
+    if (strcmp(name, "trig_mode")  == 0)
+    {
+      if (strcmp(svalue, "rise") == 0)
+        trig_mode = TRIG_RISE;
+      else
+      if (strcmp(svalue, "fall") == 0)
+        trig_mode = TRIG_FALL;
+      else
+      if (strcmp(svalue, "above") == 0)
+        trig_mode = TRIG_ABOVE;
+      else
+      if (strcmp(svalue, "below") == 0)
+        trig_mode = TRIG_BELOW;
+      else
+      if (strcmp(svalue, "window") == 0)
+        trig_mode = TRIG_WINDOW;
+      else
+        trig_mode = TRIG_OFF;
+    }
+    else
+    if (strcmp(name, "trig_ch")  == 0)
+    {
+      if (value >= 1 && value <= ADC_NUM_CHANNELS)
+        trig_ch = (uint8_t)value - 1;
+    }
+    else
+    if (strcmp(name, "trig_level")  == 0)
+      trig_level = value;
+    else
+    if (strcmp(name, "trig_level2")  == 0)
+      trig_level2 = value;
+    else
+    if (strcmp(name, "trig_pre")  == 0)
+      trig_pre = value > TRIG_PRE_MAX ? TRIG_PRE_MAX : (value > 0 ? (uint32_t)value : 0);
+    else
+    if (strcmp(name, "trig_post")  == 0)
+      trig_post = value > 0 ? (uint32_t)value : 0;
+    else
+      
+    // analog watchdog capture, see adc_watch()
+    if (strcmp(name, "awd_ch")  == 0)
+    {
+      if (value >= 0 && value <= ADC_NUM_CHANNELS)
+        awd_ch = (uint8_t)value;
+    }
+    else
+    if (strcmp(name, "awd_low")  == 0)
+      awd_low = value < 0 ? 0 : (value > 4095 ? 4095 : (uint16_t)value);
+    else
+    if (strcmp(name, "awd_high")  == 0)
+      awd_high = value < 0 ? 0 : (value > 4095 ? 4095 : (uint16_t)value);
+    else
+    if (strcmp(name, "awd_window")  == 0)
+      awd_window = value > 0 ? (uint32_t)value : 0;
+    else
+      
+    // CAN capture, see can_capture.h: canN_kbps <bit rate, 0 - off>, canN_silent 0/1,
+    // canN_filter <id> <mask> (11-bit, hex) and canN_filter_ext <id> <mask> (29-bit)
+    if (sscanf(name, "can%d_%15s", &ch, key) == 2 && ch >= 1 && ch <= CAN_BUSES)
+    {
+      unsigned long id, mask;
+      
+      if (strcmp(key, "kbps") == 0)
+        can_bus_config[ch - 1].bitrate = value > 0 ? (uint32_t)(value * 1000 + 0.5f) : 0;
+      else
+      if (strcmp(key, "silent") == 0)
+        can_bus_config[ch - 1].silent = value != 0;
+      else
+      if ((strcmp(key, "filter") == 0 || strcmp(key, "filter_ext") == 0) &&
+          sscanf(strstr(sLine, name) + strlen(name), "%lx %lx", &id, &mask) == 2)
+        can_capture_add_filter(ch - 1, id, mask, strcmp(key, "filter_ext") == 0);
+    }
+    else
+      
+    // serial capture, see serial_capture.h: serN_baud <bit rate, 0 - off> and
+    // serN_frame line|idle for USART N = 1, 2, 3, 6; gps_port N, gps_pps 0/1
+    if (sscanf(name, "ser%d_%15s", &ch, key) == 2 && ser_port_index(ch) >= 0)
+    {
+      if (strcmp(key, "baud") == 0)
+        ser_port_config[ser_port_index(ch)].baud = value >= 300 ? (uint32_t)value : 0;
+      else
+      if (strcmp(key, "frame") == 0)
+        ser_port_config[ser_port_index(ch)].mode = strcmp(svalue, "idle") == 0 ? SER_FRAME_IDLE : SER_FRAME_LINE;
+    }
+    else
+    if (strcmp(name, "gps_port")  == 0)
+      ser_gps_port = ser_port_index((int)value) >= 0 ? (uint8_t)value : 0;
+    else
+    if (strcmp(name, "gps_pps")  == 0)
+      ser_gps_pps = value != 0;
+    else
+      
+    if (strcmp(name, "format_str")  == 0)
+      strcpy(format_str, svalue);
+    else
+      
+    if (strcmp(name, "output")  == 0)
+    {
+      if (strcmp(svalue, "bin") == 0)
+        output_mode = OUTPUT_BIN;
+      else
+      if (strcmp(svalue, "lz4") == 0)
+        output_mode = OUTPUT_LZ4;
+      else
+        output_mode = OUTPUT_CSV;
+    }
+    
+  }
+  
+  if (!config_apply(cc))
+    res = 0; // a calibrated channel would log wrong values
+  
+  // every event is a capture of its own, the trigger modes do not apply
+  if (awd_window > 0)
+    trig_mode = TRIG_OFF;
+  
+  gpt_writer_period = (gptcnt_t)(sample_time*10);
+  gptStartContinuous(&GPTD4, gpt_writer_period);
+  sample_period_us = (uint32_t)(sample_time*1000);
+  
+  fclose_(file);
+    
+  return res;
+}
+
+int init_sd()
+{
+  // initializing SDC interface
+  sdcStart(&SDCD1, NULL);
+  if (sdcConnect(&SDCD1) == CH_FAILED) 
+  {
+    return 0;
+  }
+  
+  // mount the file system
+  fres = f_mount(0, &SDC_FS);
+  if (fres != FR_OK)
+  {
+    sdcDisconnect(&SDCD1);
+    return 0;
+  }
+  bFreeScanDone = 0;
+
+  
+  return 1;
+}
+//------------------------------------------------------------------------------
+/*
+ * ADC streaming callback.
+ */
+static void adccallback(ADCDriver *adcp, adcsample_t *buffer, size_t n) 
+{
+  uint32_t sum[ADC_NUM_CHANNELS];
+  uint32_t os_log2;
+  size_t k;
+  channel_config_t *cc;
+  uint8_t switched = 0;
+  
+  (void)adcp;
+  {
+//palSetPad(GPIOB, GPIOB_PIN15_LED_G);
+    
+    // n is the oversampling ratio (a power of 2), sequences follow each other in the buffer
+    os_log2 = 31 - __CLZ(n);
+    for (k = 0; k < ADC_NUM_CHANNELS; k++)
+      sum[k] = buffer[k];
+    while (--n)
+    {
+      buffer += ADC_NUM_CHANNELS;
+      for (k = 0; k < ADC_NUM_CHANNELS; k++)
+        sum[k] += buffer[k];
+    }
+    
+    // a new config takes over between two blocks, never within one
+    chSysLockFromIsr();
+    if (cfg_pending)
+    {
+      cfg_isr = cfg_pending;
+      cfg_pending = 0;
+      channel_seed |= cfg_isr->seed;
+      switched = 1;
+    }
+    cc = cfg_isr;
+    chSysUnlockFromIsr();
+    
+    samples_reindexed[0] = CHANNEL_INPUT(cc, 0, sum[0], os_log2);
+    samples_reindexed[1] = CHANNEL_INPUT(cc, 1, sum[1], os_log2);
+    samples_reindexed[2] = CHANNEL_INPUT(cc, 2, sum[2], os_log2);
+    samples_reindexed[3] = CHANNEL_INPUT(cc, 3, sum[3], os_log2);
+    samples_reindexed[4] = CHANNEL_INPUT(cc, 4, sum[6], os_log2);
+    samples_reindexed[5] = CHANNEL_INPUT(cc, 5, sum[7], os_log2);
+    samples_reindexed[6] = CHANNEL_INPUT(cc, 6, sum[4], os_log2);
+    samples_reindexed[7] = CHANNEL_INPUT(cc, 7, sum[5], os_log2);
+    
+    chSysLockFromIsr();
+    if (channel_seed)
+    {
+      // sampling restarted after a pause or the channel changed, the old filter state is meaningless
+      for (k = 0; k < ADC_NUM_CHANNELS; k++)
+        if (channel_seed & (1 << k))
+          channel_data[k] = samples_reindexed[k] * (1.0f / (1 << CALIB_FRAC_BITS));
+      channel_seed = 0;
+    }
+    chan_filter(channel_data, samples_reindexed, cc->flt_a, cc->flt_b, ADC_NUM_CHANNELS);
+    if (switched)
+      cfg_switched = 1; // the next record is the first one of the new config
+    if (trig_mode != TRIG_OFF)
+      trig_checkI();
+    chSysUnlockFromIsr();
+    
+//palClearPad(GPIOB, GPIOB_PIN15_LED_G);
+  }
+}
+
+static void adcerrorcallback(ADCDriver *adcp, adcerror_t err) 
+{
+  (void)adcp;
+  
+  // the driver has already stopped the watchdog conversion, the main loop restarts sampling
+  if (err == ADC_ERR_AWD)
+  {
+    awd_event = 1;
+    chSysLockFromIsr();
+    chEvtSignalI(main_tp, EVT_AWD);
+    chSysUnlockFromIsr();
+  }
+}
+
+/*
+ * ADC conversion group.
+ * Mode:        Continuous, 8 channels, SW triggered.
+ * Channels:    IN4..IN9, IN14, IN15.
+ * Sample times are filled in by adc_restart() from the configuration.
+ */
+static ADCConversionGroup adcgrpcfg = {
+  TRUE,
+  ADC_NUM_CHANNELS,
+  adccallback,
+  adcerrorcallback,
+  0,                        /* CR1 */
+  ADC_CR2_SWSTART,          /* CR2 */
+  0,                        /* SMPR1 */
+  0,                        /* SMPR2 */
+  ADC_SQR1_NUM_CH(ADC_NUM_CHANNELS),
+  ADC_SQR2_SQ8_N(ADC_CHANNEL_IN15) | ADC_SQR2_SQ7_N(ADC_CHANNEL_IN14),
+  ADC_SQR3_SQ6_N(ADC_CHANNEL_IN9)   | ADC_SQR3_SQ5_N(ADC_CHANNEL_IN8) |
+  ADC_SQR3_SQ4_N(ADC_CHANNEL_IN7)   | ADC_SQR3_SQ3_N(ADC_CHANNEL_IN6) |
+  ADC_SQR3_SQ2_N(ADC_CHANNEL_IN5)   | ADC_SQR3_SQ1_N(ADC_CHANNEL_IN4)
+};
+
+// ADC input of every logical channel (ch #1..#8), the PCB routing of adccallback()
+static const uint8_t channel_adc_input[ADC_NUM_CHANNELS] = {4, 5, 6, 7, 14, 15, 8, 9};
+
+// sample time settings of the ADC, ADC_SAMPLE_3..ADC_SAMPLE_480
+static const uint16_t adc_sample_cycles[8] = {3, 15, 28, 56, 84, 112, 144, 480};
+
+// (re)starts the continuous conversion with the configured sample times and oversampling
+static void adc_restart()
+{
+  uint32_t smpr1 = 0;
+  uint32_t smpr2 = 0;
+  uint32_t code;
+  int i;
+  
+  for (i = 0; i < ADC_NUM_CHANNELS; i++)
+  {
+    // shortest setting not below the requested one
+    for (code = 0; code < 7; code++)
+      if (adc_sample_cycles[code] >= channel_smp[i]) break;
+    
+    if (channel_adc_input[i] >= 10)
+      smpr1 |= code << ((channel_adc_input[i] - 10) * 3);
+    else
+      smpr2 |= code << (channel_adc_input[i] * 3);
+  }
+  
+  adcStopConversion(&ADCD1);
+  adcgrpcfg.smpr1 = smpr1;
+  adcgrpcfg.smpr2 = smpr2;
+  adcStartConversion(&ADCD1, &adcgrpcfg, samples, 2 << adc_oversample_log2);
+}
+
+static ADCConversionGroup adcwatchcfg;
+
+// replaces the sampling by the watchdog-only conversion, call adc_restart() first
+static void adc_watch()
+{
+  uint32_t input;
+  
+  adcwatchcfg = adcgrpcfg; // same sample times
+  if (awd_ch)
+  {
+    // only the watched channel is converted
+    input = channel_adc_input[awd_ch - 1];
+    adcwatchcfg.num_channels = 1;
+    adcwatchcfg.cr1 = ADC_CR1_AWDEN | ADC_CR1_AWDSGL | input;
+    adcwatchcfg.sqr1 = ADC_SQR1_NUM_CH(1);
+    adcwatchcfg.sqr2 = 0;
+    adcwatchcfg.sqr3 = ADC_SQR3_SQ1_N(input);
+  }
+  else
+    adcwatchcfg.cr1 = ADC_CR1_AWDEN;
+  
+  adcStopConversion(&ADCD1);
+  adcSTM32StartWatchdog(&ADCD1, &adcwatchcfg, awd_low, awd_high);
+}
+//------------------------------------------------------------------------------
+/* 
+ * Configure a GPT object 
+ */ 
+
+
+void gpt_writer_cb (GPTDriver *gpt_ptr) 
+{ 
+  uint32_t head;
+  sample_record_t *rec;
+  
+  (void)gpt_ptr;
+  
+  if (bLogging)
+  {
+    palTogglePad(GPIOB, GPIOB_PIN15_LED_G);
+    
+    chSysLockFromIsr();
+    head = sample_queue_head;
+    if (head - sample_queue_tail >= SAMPLE_QUEUE_DEPTH)
+    {
+      sample_queue_drops++;
+      bWriteFault = 1; // samples lost, the card did not keep up
+    }
+    else
+    {
+      rec = &sample_queue[head & (SAMPLE_QUEUE_DEPTH - 1)];
+      rec->stamp = timebase_nowI();
+      memcpy(rec->data, channel_data, sizeof(channel_data));
+      rec->flags = (trig_fired ? SAMPLE_TRIGGER : 0) | (cfg_switched ? SAMPLE_CONFIG : 0);
+      trig_fired = 0;
+      cfg_switched = 0;
+      sample_queue_head = head + 1;
+      chBSemSignalI(&sample_queue_sem);
+    }
+    chSysUnlockFromIsr();
+  }
+}
+
+// formatter scratch, used by the formatter thread only
+CCM_RAM static char sFmtLine[STRLINE_LENGTH];
+CCM_RAM static char sFmtTmp[128];
+
+static void format_record(const sample_record_t *rec)
+{
+  int i;
+  float data[ADC_NUM_CHANNELS];
+  WORD length;
+  char *p;
+  
+  sFmtLine[0] = 0;
+  
+  // timestamps are integers in microseconds, either absolute within the log
+  // or delta-encoded against the previous row
+  if (bIncludeTimestamp == 2)
+    format_u64(sFmtLine, rec->stamp - last_stamp_us);
+  else
+  if (bIncludeTimestamp)
+    format_u64(sFmtLine, rec->stamp - log_start_us);
+  last_stamp_us = rec->stamp;
+  
+  chan_calibrate(data, rec->data, cfg_fmt->eff_gain, cfg_fmt->offset, ADC_NUM_CHANNELS);
+  
+  for (i = 0; i < ADC_NUM_CHANNELS; i++) 
+  {
+    if (cfg_fmt->en[i])
+    {
+      sprintf(sFmtTmp, format_str, data[i]);
+      strcat(sFmtLine, ",");
+      strcat(sFmtLine, sFmtTmp);
+    }
+  }
+  
+  strcat(sFmtLine, "\r\n");
+  
+  length = strlen(sFmtLine);
+  p = fbuffer_reserve(length);
+  index_note(sample_counter, rec->stamp - log_start_us, fbuffer_offset()); // after the reserve, it may flush and pad
+  memcpy(p, sFmtLine, length);
+  fbuffer_commit(length);
+}
+
+static void emit_record(const sample_record_t *rec)
+{
+  if (output_mode == OUTPUT_BIN)
+    bin_add_record(rec);
+  else
+    format_record(rec);
+}
+
+// triggered mode: rec is record number sample_counter
+static void trig_process(const sample_record_t *rec)
+{
+  uint32_t counter = sample_counter;
+  uint32_t n;
+  
+  if (trig_post_left == 0)
+  {
+    if ((rec->flags & SAMPLE_TRIGGER) == 0)
+    {
+      // armed, only keep the history
+      trig_ring[trig_ring_count & (TRIG_PRE_MAX - 1)] = *rec;
+      trig_ring_count++;
+      return;
+    }
+    
+    write_trigger_mark(sFmtLine, rec->stamp);
+    
+    // the history first, oldest record first, with its own sample numbers
+    n = trig_ring_count < trig_pre ? trig_ring_count : trig_pre;
+    for (; n > 0; n--)
+    {
+      sample_counter = counter - n;
+      emit_record(&trig_ring[(trig_ring_count - n) & (TRIG_PRE_MAX - 1)]);
+    }
+    sample_counter = counter;
+    
+    trig_ring_count = 0;
+    trig_post_left = trig_post + 1; // the trigger record itself and trig_post after it
+  }
+  
+  emit_record(rec);
+  
+  if (--trig_post_left == 0)
+  {
+    // capture complete, get it to the card and wait for the next one
+    if (output_mode == OUTPUT_BIN)
+      bin_flush_frame();
+    bReqFlush = 1;
+    trig_armed = bLogging;
+  }
+}
+
+// the current segment is full or old enough
+static int rotation_due()
+{
+  if (rotate_bytes && fbuffer_offset() >= rotate_bytes)
+    return 1;
+  if (rotate_period && chTimeElapsedSince(stSegStart) >= S2ST(rotate_period))
+    return 1;
+  
+  return 0;
+}
+
+// finishes the current segment and starts the next one with the record at stamp,
+// the writer switches files when it gets to the buffer boundary
+static void rotate_log(uint64_t stamp)
+{
+  if (output_mode == OUTPUT_BIN)
+    bin_close_log();
+  
+  seg_pending_first_sample = sample_counter;
+  seg_pending_first_us = stamp - log_start_us;
+  seg_end_pending = SEG_END_ROTATE;
+  request_write();
+  
+  log_file_offset = 0;
+  idx_next_sample = 0; // the first record of every segment is indexed
+  stSegStart = chTimeNow();
+  write_log_header(sFmtLine, sFmtTmp);
+}
+
+// the record at stamp is the first one sampled with the config the ADC
+// callback switched to; other enabled channels need other columns, so that
+// starts a new segment with its own header
+static void config_switch(uint64_t stamp)
+{
+  int columns = memcmp(cfg_fmt->en, cfg_isr->en, sizeof(cfg_fmt->en)) != 0;
+  
+  cfg_fmt = cfg_isr;
+  if (columns)
+    rotate_log(stamp);
+  else
+  if (output_mode == OUTPUT_BIN)
+    bin_flush_frame(); // the frame so far is in the old calibration
+  
+  // the history of a triggered capture was sampled with the old config
+  if (trig_mode != TRIG_OFF)
+    trig_ring_count = 0;
+  
+  write_config_record(sFmtLine, stamp);
+}
+
+// CAN and serial frames received up to limit (timebase us) go into the log,
+// oldest first, in between the sample records; a serial frame is in its ring
+// only once complete, it can come up to its own length behind the samples
+static void capture_emit_until(uint64_t limit)
+{
+  const can_record_t *c;
+  const ser_record_t *u;
+  uint64_t utc_us, stamp;
+  
+  while (TRUE)
+  {
+    c = can_capture_peek();
+    u = ser_capture_peek();
+    if (c != 0 && c->stamp > limit) c = 0;
+    if (u != 0 && u->stamp > limit) u = 0;
+    
+    if (c != 0 && (u == 0 || c->stamp <= u->stamp))
+    {
+      write_can_frame(sFmtLine, c);
+      can_capture_pop();
+    }
+    else
+    if (u != 0)
+    {
+      write_ser_frame(sFmtLine, u);
+      if (ser_gps_pair(u, &utc_us, &stamp))
+        write_gps_sync(sFmtLine, utc_us, stamp);
+      ser_capture_pop();
+    }
+    else
+      break;
+  }
+}
+
+CCM_RAM static WORKING_AREA(waFormatter, 2048);
+
+// converts queued records to text in batches and hands full buffers to the writer
+static msg_t formatter_thread(void *arg)
+{
+  uint32_t tail;
+  uint64_t limit;
+  uint32_t cycles;
+  
+  (void)arg;
+  chRegSetThreadName("formatter");
+  
+  while (TRUE)
+  {
+    chBSemWaitTimeout(&sample_queue_sem, MS2ST(500));
+    
+    limit = timebase_now(); // every sample stamped before this is in the queue already
+    tail = sample_queue_tail;
+    if (sample_queue_head - tail > sample_queue_peak)
+      sample_queue_peak = sample_queue_head - tail;
+    while (tail != sample_queue_head)
+    {
+      cycles = DWT->CYCCNT;
+      capture_emit_until(sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].stamp);
+      if (sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].flags & SAMPLE_CONFIG)
+        config_switch(sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].stamp);
+      else
+      if (rotation_due())
+        rotate_log(sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].stamp);
+      
+      if (trig_mode == TRIG_OFF)
+      {
+        // watchdog captures mark their first record
+        if (sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].flags & SAMPLE_TRIGGER)
+          write_trigger_mark(sFmtLine, sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)].stamp);
+        emit_record(&sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)]);
+      }
+      else
+        trig_process(&sample_queue[tail & (SAMPLE_QUEUE_DEPTH - 1)]);
+      sample_counter++;
+      tail++;
+      sample_queue_tail = tail;
+      
+      cycles = DWT->CYCCNT - cycles;
+      if (cycles > fmt_record_peak)
+        fmt_record_peak = cycles;
+    }
+    capture_emit_until(limit);
+    
+    if (bLogging && rtc_sync_period > 0 && chTimeElapsedSince(stLastRtcSync) >= S2ST(rtc_sync_period))
+      write_rtc_sync(sFmtLine);
+    
+    // maybe we need to write log, because we didnt for long time?
+    // not before start_log is done with the header, it uses sd_buffer too
+    if (bReqFlush || (bLogging && chTimeElapsedSince(stLastWriting) > S2ST(5)))
+    {
+      if (output_mode == OUTPUT_BIN)
+      {
+        if (bReqClose)
+          bin_close_log();
+        else
+          bin_flush_frame();
+      }
+      if (bReqClose)
+        seg_end_pending = SEG_END_CLOSE; // the writer closes the file after this buffer
+      bReqClose = 0;
+      bReqFlush = 0;
+      if (sd_buffer_length > 0 || seg_end_pending) // there is data to write
+      {
+        // request write operation
+        request_write();
+      }
+    }
+  }
+  
+  return 0;
+}
+
+static GPTConfig gpt_writer_config = 
+{ 
+     10000,  // timer clock: 1Mhz 
+     gpt_writer_cb  // Timer callback function 
+};
+//------------------------------------------------------------------------------
+#define BUTTON_DEBOUNCE_MS  30 // the pin has to be quiet this long after its last edge
+
+static VirtualTimer button_vt;
+
+// debounce timer expired -- the pin has been stable for BUTTON_DEBOUNCE_MS
+static void button_vt_cb(void *arg) 
+{
+  uint8_t level = palReadPad(GPIOC, GPIOC_PIN6_BTN);
+  
+  (void)arg;
+  
+  if (level != bButton)
+  {
+    bButton = level;
+    if (level)
+      chEvtSignalI(main_tp, EVT_BUTTON); // only presses start or stop logging
+  }
+}
+
+// every edge of the button pin restarts the debounce timer
+static void button_ext_cb(EXTDriver *extp, expchannel_t channel) 
+{
+  (void)extp;
+  (void)channel;
+  
+  chSysLockFromIsr();
+  if (chVTIsArmedI(&button_vt))
+    chVTResetI(&button_vt);
+  chVTSetI(&button_vt, MS2ST(BUTTON_DEBOUNCE_MS), button_vt_cb, NULL);
+  chSysUnlockFromIsr();
+}
+
+static const EXTConfig extcfg = 
+{
+  {
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_BOTH_EDGES | EXT_CH_MODE_AUTOSTART | EXT_MODE_GPIOC, button_ext_cb}, // PC6, button
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_DISABLED, NULL},
+    {EXT_CH_MODE_RISING_EDGE | EXT_MODE_GPIOD, ser_pps_cb}, // PD13, GPS PPS, enabled with gps_pps
+    // the remaining lines are disabled
+  }
+};
+
 
-  fwrite_string(sLine);
-  align_buffer();
-  fwrite_(sd_buffer, 1, sd_buffer_length, file);
-  f_sync(file);
 
-  // reset buffer counters
-  sd_buffer_length_for_write = 0;
-  sd_buffer_length = 0;
+/*===========================================================================*/
+// console: ChibiOS shell on UART4 (PA0 TX, PA1 RX, 115200 8N1)
+//
+// The shell thread runs below the main loop and the formatter, and sampling
+// is done in interrupts, so no command delays the acquisition. Card mounts
+// and config reloads are asked of the main loop (EVT_CONSOLE); file reads go
+// through the reentrant FatFs and can delay a card write by one sector read,
+// which the sample queue absorbs.
 
-  bWriteFault = 0;
+#define CON_REQ_MOUNT   1 // mount the card if it is not
+#define CON_REQ_RELOAD  2 // ... and apply ADC.txt (only the channel settings while logging)
 
-  stLastWriting = chTimeNow(); // record time when we did write
+static volatile uint8_t console_req;
+static int console_result;
+static BinarySemaphore console_done_sem;
 
-  bLogging = 1;
+CCM_RAM static WORKING_AREA(waShell, 2048); // commands hand only con_buf to the SDIO DMA
+static char con_line[STRLINE_LENGTH];
+static uint32_t con_buf[512 / 4]; // SRAM and word aligned, the SDIO DMA reads into it
+static char con_lfn[_MAX_LFN + 1];
+
+// shell thread: has the main loop do req, returns its result
+static int console_request(uint8_t req)
+{
+  console_req = req;
+  chEvtSignal(main_tp, EVT_CONSOLE);
+  chBSemWait(&console_done_sem);
+  return console_result;
 }
 
+// 1 if the first word of the config line pLine is name
+static int config_line_is(const char *pLine, const char *name)
+{
+  size_t n = strlen(name);
+  
+  while (*pLine == ' ' || *pLine == '\t') pLine++;
+  return strncmp(pLine, name, n) == 0 && (pLine[n] == ' ' || pLine[n] == '\t' ||
+                                          pLine[n] == '\r' || pLine[n] == '\n' || pLine[n] == 0);
+}
 
+// stats [clear]: queue fill, drops and the peak time of every stage
+static void cmd_stats(BaseSequentialStream *chp, int argc, char *argv[])
+{
+  uint32_t mhz = STM32_SYSCLK / 1000000;
+  
+  if (argc > 0 && strcmp(argv[0], "clear") == 0)
+  {
+    sample_queue_peak = 0;
+    fmt_record_peak = 0;
+    write_waits = 0;
+    write_peak = 0;
+    return;
+  }
+  
+  chprintf(chp, "logging      %s, %lu samples, %lu bytes in segment %d\r\n",
+           bLogging ? "yes" : "no", sample_counter, log_file_offset, seg_number);
+  chprintf(chp, "sample queue %lu/%d peak, %lu dropped\r\n",
+           sample_queue_peak, SAMPLE_QUEUE_DEPTH, sample_queue_drops);
+  chprintf(chp, "formatter    %lu us peak per record\r\n", fmt_record_peak / mhz);
+  chprintf(chp, "writer       %lu ms peak per buffer, %lu waits, fault %d\r\n",
+           (uint32_t)write_peak * 1000 / CH_FREQUENCY, write_waits, bWriteFault);
+  if (output_mode == OUTPUT_LZ4)
+    chprintf(chp, "lz4          %lu us last block\r\n", lz4_last_cycles / mhz);
+  chprintf(chp, "can          %lu frames, %lu dropped\r\n", can_frames, can_ring_drops);
+  chprintf(chp, "serial       %lu frames, %lu dropped, %lu errors\r\n",
+           ser_frames, ser_ring_drops, ser_errors);
+}
 
-int read_config_file()
+// a live change refused by config_reload_live()
+static void cfg_no_tables(BaseSequentialStream *chp)
 {
-  float value;
-  char name[64];
-  char svalue[64];
-  float sample_time;
-  int res = 0;
-  int i;
+  chprintf(chp, "channel settings not applied: the curves need more calibration tables than\r\n"
+                "are free while logging (%d in all), they apply at the next log start\r\n", CALIB_LUT_COUNT);
+}
 
-  bIncludeTimestamp = 1;
+// cfg get [name]: lines of ADC.txt (all or of name)
+// cfg set name [value ...]: replaces the lines of name in ADC.txt with one,
+// or removes them without a value; applied right away if not logging, while
+// logging the channel settings (chN_en/zero/gain/filt/poly/pwl) are switched
+// live and the rest waits for the next log start
+// cfg reload: applies ADC.txt as it is, the same way
+static void cmd_cfg(BaseSequentialStream *chp, int argc, char *argv[])
+{
+  file_t *src, *dst;
+  int i, done = 0;
   
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_en[i] = 0; // all channels disabled by default
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_zero[i] = 0;
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_gain[i] = 1;
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_fltorder[i] = 1;
-  strcpy(format_str, "%f");
+  if (argc < 1 || (strcmp(argv[0], "set") == 0 && argc < 2) ||
+      (strcmp(argv[0], "set") != 0 && strcmp(argv[0], "get") != 0 && strcmp(argv[0], "reload") != 0))
+  {
+    chprintf(chp, "usage: cfg get [name] | cfg set name [value ...] | cfg reload\r\n");
+    return;
+  }
+  if (!console_request(CON_REQ_MOUNT))
+  {
+    chprintf(chp, "no card\r\n");
+    return;
+  }
   
-  // read file
-  file = fopen_("ADC.txt", "r");
-  if (file == 0) 
+  if (strcmp(argv[0], "reload") == 0)
   {
-    return 0;
+    i = console_request(CON_REQ_RELOAD);
+    if (i == CFG_NO_TABLES)
+      cfg_no_tables(chp);
+    else
+    if (i)
+      chprintf(chp, bLogging ? "channel settings applied\r\n" : "applied\r\n");
+    else
+      chprintf(chp, bLogging ? "the previous change is still being applied\r\n"
+                             : "not accepted (no sample line?)\r\n");
+    return;
   }
   
-  while( f_gets(sLine, STRLINE_LENGTH, file) )
+  src = fopen_("ADC.txt", "r");
+  if (strcmp(argv[0], "get") == 0)
   {
-    if (sscanf(sLine, "%s %f", name, &value) < 2)
+    if (src == 0)
     {
-      if (sscanf(sLine, "%s %s", name, svalue) < 2)
-      {
-        continue;
-      }        
+      chprintf(chp, "no ADC.txt\r\n");
+      return;
     }
-    
-    if (strcmp(name, "sample") == 0)
+    while (fgets_(con_line, STRLINE_LENGTH, src))
     {
-      sample_time = value; 
-      res = 1; // at least we got sample time, config file accepted
+      con_line[strcspn(con_line, "\r\n")] = 0;
+      if (argc < 2 || config_line_is(con_line, argv[1]))
+        chprintf(chp, "%s\r\n", con_line);
     }
-    else
-    if (strcmp(name, "timestamp")  == 0)
+    fclose_(src);
+    return;
+  }
+  
+  // a new file next to the old one, swapped in when complete
+  dst = fopen_("ADC.tmp", "w");
+  if (dst == 0)
+  {
+    chprintf(chp, "can not write the card\r\n");
+    if (src) fclose_(src);
+    return;
+  }
+  
+  strcpy(con_line, argv[1]);
+  for (i = 2; i < argc; i++)
+  {
+    strcat(con_line, " ");
+    strcat(con_line, argv[i]);
+  }
+  strcat(con_line, "\r\n");
+  
+  while (src && fgets_((char *)con_buf, sizeof(con_buf), src))
+  {
+    if (config_line_is((char *)con_buf, argv[1]))
     {
-      bIncludeTimestamp = value;
+      if (argc > 2 && !done)
+        fwrite_(con_line, 1, strlen(con_line), dst);
+      done = 1;
     }
     else
-      
-    if (strcmp(name, "ch1_en")  == 0)
-      channel_en[0] = (int)value; 
-    else
-    if (strcmp(name, "ch2_en")  == 0)
-      channel_en[1] = (int)value; 
-    else
-    if (strcmp(name, "ch3_en")  == 0)
-      channel_en[2] = (int)value; 
-    else
-    if (strcmp(name, "ch4_en")  == 0)
-      channel_en[3] = (int)value; 
-    else
-    if (strcmp(name, "ch5_en")  == 0)
-      channel_en[4] = (int)value; 
-    else
-    if (strcmp(name, "ch6_en")  == 0)
-      channel_en[5] = (int)value; 
-    else
-    if (strcmp(name, "ch7_en")  == 0)
-      channel_en[6] = (int)value; 
-    else
-    if (strcmp(name, "ch8_en")  == 0)
-      channel_en[7] = (int)value;  
-    else
-      
-    if (strcmp(name, "ch1_zero")  == 0)
-      channel_zero[0] = value;
-    else
-    if (strcmp(name, "ch2_zero")  == 0)
-      channel_zero[1] = value;
-    else
-    if (strcmp(name, "ch3_zero")  == 0)
-      channel_zero[2] = value;
-    else
-    if (strcmp(name, "ch4_zero")  == 0)
-      channel_zero[3] = value;
-    else
-    if (strcmp(name, "ch5_zero")  == 0)
-      channel_zero[4] = value;
-    else
-    if (strcmp(name, "ch6_zero")  == 0)
-      channel_zero[5] = value;
-    else
-    if (strcmp(name, "ch7_zero")  == 0)
-      channel_zero[6] = value;
-    else
-    if (strcmp(name, "ch8_zero")  == 0)
-      channel_zero[7] = value;
-    else
-      
-    if (strcmp(name, "ch1_gain")  == 0)
-      channel_gain[0] = value;
-    else
-    if (strcmp(name, "ch2_gain")  == 0)
-      channel_gain[1] = value;
-    else
-    if (strcmp(name, "ch3_gain")  == 0)
-      channel_gain[2] = value;
-    else
-    if (strcmp(name, "ch4_gain")  == 0)
-      channel_gain[3] = value;
-    else
-    if (strcmp(name, "ch5_gain")  == 0)
-      channel_gain[4] = value;
-    else
-    if (strcmp(name, "ch6_gain")  == 0)
-      channel_gain[5] = value;
-    else
-    if (strcmp(name, "ch7_gain")  == 0)
-      channel_gain[6] = value;
-    else
-    if (strcmp(name, "ch8_gain")  == 0)
-      channel_gain[7] = value;
-    else
-      
-    if (strcmp(name, "ch1_filt")  == 0)
-      channel_fltorder[0] = value;
-    else
-    if (strcmp(name, "ch2_filt")  == 0)
-      channel_fltorder[1] = value;
-    else
-    if (strcmp(name, "ch3_filt")  == 0)
-      channel_fltorder[2] = value;
-    else
-    if (strcmp(name, "ch4_filt")  == 0)
-      channel_fltorder[3] = value;
-    else
-    if (strcmp(name, "ch5_filt")  == 0)
-      channel_fltorder[4] = value;
-    else
-    if (strcmp(name, "ch6_filt")  == 0)
-      channel_fltorder[5] = value;
-    else
-    if (strcmp(name, "ch7_filt")  == 0)
-      channel_fltorder[6] = value;
+      fwrite_(con_buf, 1, strlen((char *)con_buf), dst);
+  }
+  if (argc > 2 && !done)
+    fwrite_(con_line, 1, strlen(con_line), dst);
+  
+  if (src) fclose_(src);
+  fclose_(dst);
+  f_unlink("ADC.txt");
+  if (f_rename("ADC.tmp", "ADC.txt") != FR_OK)
+  {
+    chprintf(chp, "can not rename ADC.tmp to ADC.txt\r\n");
+    return;
+  }
+  
+  if (bLogging)
+  {
+    i = console_request(CON_REQ_RELOAD);
+    if (i == CFG_NO_TABLES)
+      cfg_no_tables(chp);
     else
-    if (strcmp(name, "ch8_filt")  == 0)
-      channel_fltorder[7] = value;
+    if (i)
+      chprintf(chp, "saved, channel settings applied now, the rest at the next log start\r\n");
     else
-      
-    if (strcmp(name, "format_str")  == 0)
-      strcpy(format_str, svalue);
-    
+      chprintf(chp, "saved, the previous change is still being applied, try cfg reload\r\n");
   }
+  else
+  if (!console_request(CON_REQ_RELOAD))
+    chprintf(chp, "saved, but not accepted (no sample line?)\r\n");
+}
+
+// tail [ms [count]]: calibrated values of the enabled channels every ms
+// (default 500), count rows or until a key is pressed
+static void cmd_tail(BaseSequentialStream *chp, int argc, char *argv[])
+{
+  float raw[ADC_NUM_CHANNELS], data[ADC_NUM_CHANNELS];
+  channel_config_t *cc;
+  uint32_t every = argc > 0 ? atoi(argv[0]) : 500;
+  uint32_t count = argc > 1 ? atoi(argv[1]) : 0;
+  char *p;
+  int i;
   
-  gptStartContinuous(&GPTD4, sample_time*10);
+  if (every < 10) every = 10;
   
-  fclose_(file);
+  do
+  {
+    chSysLock();
+    memcpy(raw, channel_data, sizeof(raw));
+    cc = cfg_isr;
+    chSysUnlock();
+    chan_calibrate(data, raw, cc->eff_gain, cc->offset, ADC_NUM_CHANNELS);
     
-  return res;
+    p = con_line;
+    for (i = 0; i < ADC_NUM_CHANNELS; i++)
+    {
+      if (cc->en[i])
+      {
+        *p++ = ',';
+        p += sprintf(p, format_str, data[i]);
+      }
+    }
+    *p = 0;
+    chprintf(chp, "%s\r\n", con_line[0] ? con_line + 1 : "no channel enabled");
+  }
+  while ((count == 0 || --count > 0) &&
+         chnGetTimeout((BaseChannel *)chp, MS2ST(every)) == Q_TIMEOUT);
 }
 
-int init_sd()
+// ls [dir]: files with their sizes
+static void cmd_ls(BaseSequentialStream *chp, int argc, char *argv[])
 {
-  // initializing SDC interface
-  sdcStart(&SDCD1, NULL);
-  if (sdcConnect(&SDCD1) == CH_FAILED) 
+  DIR dir;
+  FILINFO fno;
+  
+  if (!console_request(CON_REQ_MOUNT))
   {
-    return 0;
+    chprintf(chp, "no card\r\n");
+    return;
   }
-  
-  // mount the file system
-  fres = f_mount(0, &SDC_FS);
-  if (fres != FR_OK)
+  if (f_opendir(&dir, argc > 0 ? argv[0] : "") != FR_OK)
   {
-    sdcDisconnect(&SDCD1);
-    return 0;
+    chprintf(chp, "no such directory\r\n");
+    return;
   }
   
-  // trying just dummy read file
-  file = fopen_("Config.txt", "r");
-  if (file)
-    fclose_(file);
-
-  
-  return 1;
+  fno.lfname = con_lfn;
+  fno.lfsize = sizeof(con_lfn);
+  while (f_readdir(&dir, &fno) == FR_OK && fno.fname[0])
+  {
+    if (fno.fattrib & (AM_HID | AM_SYS)) continue;
+    chprintf(chp, "%10lu  %s%s\r\n", fno.fsize, con_lfn[0] ? con_lfn : fno.fname,
+             (fno.fattrib & AM_DIR) ? "/" : "");
+  }
 }
-//------------------------------------------------------------------------------
-/*
- * ADC streaming callback.
- */
-static void adccallback(ADCDriver *adcp, adcsample_t *buffer, size_t n) 
+
+// get file: "<size>\r\n" and then the bytes of the file as they are; the log
+// being written can be read up to its last written buffer
+static void cmd_get(BaseSequentialStream *chp, int argc, char *argv[])
 {
-  (void)adcp;
-  if (samples == buffer) 
+  file_t *f;
+  size_t n;
+  
+  if (argc < 1)
   {
-//palSetPad(GPIOB, GPIOB_PIN15_LED_G);
-    
-    samples_reindexed[0] = samples[0];
-    samples_reindexed[1] = samples[1];
-    samples_reindexed[2] = samples[2];
-    samples_reindexed[3] = samples[3];
-    samples_reindexed[4] = samples[6];
-    samples_reindexed[5] = samples[7];
-    samples_reindexed[6] = samples[4];
-    samples_reindexed[7] = samples[5];
-    
-    chSysLockFromIsr();
-    for (i = 0; i < ADC_NUM_CHANNELS; i++) 
-    {
-      if (channel_en[i])
-      {    
-        channel_data[i] = channel_data[i]*((channel_fltorder[i] - 1)/channel_fltorder[i]) + samples_reindexed[i]/channel_fltorder[i];
-      }
-    }
-    chSysUnlockFromIsr();
-    
-//palClearPad(GPIOB, GPIOB_PIN15_LED_G);
+    chprintf(chp, "usage: get file\r\n");
+    return;
+  }
+  if (!console_request(CON_REQ_MOUNT) || (f = fopen_(argv[0], "r")) == 0)
+  {
+    chprintf(chp, "can not open %s\r\n", argv[0]);
+    return;
   }
+  
+  chprintf(chp, "%lu\r\n", fsize_(f));
+  while ((n = fread_(con_buf, 1, sizeof(con_buf), f)) > 0)
+    chSequentialStreamWrite(chp, (uint8_t *)con_buf, n);
+  fclose_(f);
 }
 
-static void adcerrorcallback(ADCDriver *adcp, adcerror_t err) 
+// bench [frames]: cycles per frame of the channel kernels (default 10000
+// frames); compare soft- and hard-float builds with it, interrupts stay on,
+// so run it while not logging
+static void cmd_bench(BaseSequentialStream *chp, int argc, char *argv[])
 {
-  (void)adcp;
-  (void)err;
+  chan_dsp_bench_t res;
+  
+  chan_dsp_bench(&res, ADC_NUM_CHANNELS, argc > 0 ? atoi(argv[0]) : 10000);
+  chprintf(chp, "%lu frames, %s, cycles per frame: %lu old filter, %lu filter, %lu calibrate\r\n",
+           res.frames, res.fpu ? "hard-float" : "soft-float", res.legacy, res.filter, res.calibrate);
 }
 
-/*
- * ADC conversion group.
- * Mode:        Continuous, 16 samples of 8 channels, SW triggered.
- * Channels:    IN11, IN12, IN11, IN12, IN11, IN12, Sensor, VRef.
- */
-static const ADCConversionGroup adcgrpcfg = {
-  TRUE,
-  ADC_NUM_CHANNELS,
-  adccallback,
-  adcerrorcallback,
-  0,                        /* CR1 */
-  ADC_CR2_SWSTART,          /* CR2 */
-  ADC_SMPR1_SMP_AN15(ADC_SAMPLE_480) | ADC_SMPR1_SMP_AN14(ADC_SAMPLE_480),
-  ADC_SMPR2_SMP_AN4(ADC_SAMPLE_480) | ADC_SMPR2_SMP_AN5(ADC_SAMPLE_480) | ADC_SMPR2_SMP_AN6(ADC_SAMPLE_480) | ADC_SMPR2_SMP_AN7(ADC_SAMPLE_480) | ADC_SMPR2_SMP_AN8(ADC_SAMPLE_480) | ADC_SMPR2_SMP_AN9(ADC_SAMPLE_480),                        /* SMPR2 */
-  ADC_SQR1_NUM_CH(ADC_NUM_CHANNELS),
-  ADC_SQR2_SQ8_N(ADC_CHANNEL_IN15) | ADC_SQR2_SQ7_N(ADC_CHANNEL_IN14),
-  ADC_SQR3_SQ6_N(ADC_CHANNEL_IN9)   | ADC_SQR3_SQ5_N(ADC_CHANNEL_IN8) |
-  ADC_SQR3_SQ4_N(ADC_CHANNEL_IN7)   | ADC_SQR3_SQ3_N(ADC_CHANNEL_IN6) |
-  ADC_SQR3_SQ2_N(ADC_CHANNEL_IN5)   | ADC_SQR3_SQ1_N(ADC_CHANNEL_IN4)
+static const ShellCommand console_commands[] =
+{
+  {"stats", cmd_stats},
+  {"cfg", cmd_cfg},
+  {"tail", cmd_tail},
+  {"ls", cmd_ls},
+  {"get", cmd_get},
+  {"bench", cmd_bench},
+  {NULL, NULL}
 };
-//------------------------------------------------------------------------------
-/* 
- * Configure a GPT object 
- */ 
 
-void gpt_writer_cb (GPTDriver *gpt_ptr) 
-{ 
-  int i;
-  float data;
-  
-  if (bLogging)
-  {
-//palSetPad(GPIOB, GPIOB_PIN13_LED_R);
-    palTogglePad(GPIOB, GPIOB_PIN15_LED_G);
-    
-    // write down data
-    sLine[0] = 0;
-    
-    if (bIncludeTimestamp)
-      sprintf(sLine, "%d", chTimeNow());
-    
-    for (i = 0; i < ADC_NUM_CHANNELS; i++) 
-    {
-      if (channel_en[i])
-      {
-        //data = (samples[i]-channel_zero[i])*channel_gain[i];
-        
-        //channel_data[i] = channel_data[i]*((channel_fltorder[i] - 1)/channel_fltorder[i]) + data/channel_fltorder[i];
-        data = (channel_data[i]-channel_zero[i])*channel_gain[i];
-        
-        sprintf(sTmp, format_str, data);
-        strcat(sLine, ",");
-        strcat(sLine, sTmp);
-      }
-    }
-    
-    strcat(sLine, "\r\n");
+static const ShellConfig console_config =
+{
+  (BaseSequentialStream *)&SD4,
+  console_commands
+};
 
-    chSysLockFromIsr();
-    fwrite_string(sLine);
-    chSysUnlockFromIsr();
-    
-//palClearPad(GPIOB, GPIOB_PIN13_LED_R);
-  }
+static void console_start()
+{
+  chBSemInit(&console_done_sem, TRUE);
+  
+  palSetPadMode(GPIOA, GPIOA_PIN0, PAL_MODE_ALTERNATE(8));
+  palSetPadMode(GPIOA, GPIOA_PIN1_ETH_OSCIN, PAL_MODE_ALTERNATE(8));
+  sdStart(&SD4, NULL);
+  
+  shellInit();
+  shellCreateStatic(&console_config, waShell, sizeof(waShell), NORMALPRIO - 1);
 }
 
-static GPTConfig gpt_writer_config = 
-{ 
-     10000,  // timer clock: 1Mhz 
-     gpt_writer_cb  // Timer callback function 
-};
-//------------------------------------------------------------------------------
-int iButtonStableCounter = 0;
-unsigned char bButtonNew = 0;
-unsigned char bButtonPrev = 0;
-#define BUTTON_COUNTER_THRESHOLD 50000
-
 
 
 /*
@@ -506,15 +2337,33 @@ int main(void)
   
   halInit();
   chSysInit();
+  finit_();
+  
+  // cycle counter, used to measure the processing stages
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
   
   palSetPad(GPIOB, GPIOB_PIN15_LED_G);
  
+  chBSemInit(&sample_queue_sem, TRUE);
+  chBSemInit(&write_done_sem, TRUE);
+  
+  main_tp = chThdSelf();
+  
+  // above the main loop, so formatting goes on while the card is written --
+  // no formatting happens in interrupt context any more
+  chThdCreateStatic(waFormatter, sizeof(waFormatter), NORMALPRIO + 1, formatter_thread, NULL);
+  
+  timebase_init();
   gptStart(&GPTD4, &gpt_writer_config); 
   
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_en[i] = 0; // all channels disabled by default
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_zero[i] = 0;
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_gain[i] = 1;
-  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_fltorder[i] = 4;
+  channel_config_defaults(cfg_isr);
+  for (i = 0; i < ADC_NUM_CHANNELS; i++) cfg_isr->fltorder[i] = 4;
+  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_smp[i] = 480;
+  for (i = 0; i < ADC_NUM_CHANNELS; i++) channel_data[i] = 0; // CCM is not zeroed at startup
+  update_channel_coefs(cfg_isr, 0);
+  
+  console_start();
   
    /*
    * Initializes the ADC driver 1 and enable the thermal sensor.
@@ -523,49 +2372,115 @@ int main(void)
   adcStart(&ADCD1, NULL);
   adcSTM32EnableTSVREFE();
 
-  adcStartConversion(&ADCD1, &adcgrpcfg, samples, ADC_BUF_DEPTH);
+  adc_restart();
   
+  // the button is served by EXTI, the main loop sleeps until something happens
+  bButton = palReadPad(GPIOC, GPIOC_PIN6_BTN);
+  extStart(&EXTD1, &extcfg);
 
   i = 0;
   while (TRUE) 
   {
-INDICATE_IDLE_ON();
+    eventmask_t evt;
+    systime_t timeout = TIME_INFINITE;
     
-    // maybe we need to write log, because we didnt for long time?
-    if (chTimeElapsedSince(stLastWriting) > S2ST(5))
+    // an analog watchdog capture window has to be closed on time
+    if (awd_capturing)
     {
-      if (sd_buffer_length > 0) // there is data to write
-      {
-        // request write operation
-        request_write();
-      }
+      systime_t elapsed = chTimeElapsedSince(stAwdCaptureStart);
+      timeout = (elapsed < MS2ST(awd_window)) ? MS2ST(awd_window) - elapsed : TIME_IMMEDIATE;
     }
     
+    // sleep until there is something to write, a watchdog event or a button press
+    evt = (timeout == TIME_IMMEDIATE) ? 0 : chEvtWaitAnyTimeout(ALL_EVENTS, timeout);
+    
+INDICATE_IDLE_ON();
+    
     if (bReqWrite)
     {
+      systime_t stWrite = chTimeNow();
+      
       //palSetPad(GPIOD, GPIOD_PIN_15_BLUELED);
 INDICATE_IDLE_OFF();
-      if (fwrite_(sd_buffer_for_write, 1, sd_buffer_length_for_write, file) != sd_buffer_length_for_write)
+      if (file == 0 || fwrite_(sd_buffer_for_write, 1, sd_buffer_length_for_write, file) != sd_buffer_length_for_write)
         bWriteFault = 2;
-      if (f_sync(file) != FR_OK)
+      else
+      if (fsync_(file) != 0)
         bWriteFault = 2;
+      if (chTimeElapsedSince(stWrite) > write_peak)
+        write_peak = chTimeElapsedSince(stWrite);
+      log_index_write(); // only after the data it points at
+      if (seg_end_write)
+      {
+        if (file)
+          log_segment_end(seg_end_write);
+        seg_end_write = SEG_END_NONE;
+      }
+      else
+      if (bLogging && (rotate_bytes || rotate_period))
+        log_prealloc_step(); // one step per buffer, the formatter keeps filling the other one
+      if (!bFreeScanDone)
+      {
+        // free cluster map, later allocations skip the full parts of the FAT
+        DWORD nclst;
+        if (f_scanfree("", FREE_SCAN_STEP, &nclst) != FR_OK || nclst != 0xFFFFFFFF)
+          bFreeScanDone = 1;
+      }
 INDICATE_IDLE_ON();        
       bReqWrite = 0;
+      chBSemSignal(&write_done_sem);
       
       stLastWriting = chTimeNow(); // record time when we did write
       
       //palClearPad(GPIOD, GPIOD_PIN_15_BLUELED);
     }
     
+    // analog watchdog capture: log for awd_window ms after every event, then watch again
+    if (bLogging && awd_window > 0)
+    {
+      if (awd_event)
+      {
+        awd_event = 0;
+        channel_seed = CHANNEL_SEED_ALL;
+        trig_fired = 1; // the first record gets the trigger mark
+        adc_restart();
+        gptStartContinuous(&GPTD4, gpt_writer_period);
+        awd_capturing = 1;
+        stAwdCaptureStart = chTimeNow();
+      }
+      else
+      if (awd_capturing && chTimeElapsedSince(stAwdCaptureStart) >= MS2ST(awd_window))
+      {
+        gptStopTimer(&GPTD4);
+        awd_capturing = 0;
+        bReqFlush = 1;
+        chBSemSignal(&sample_queue_sem);
+        adc_watch();
+      }
+    }
+    
     // start-stop log button handling
-    if (bButton && bButtonPrev == 0)
+    if (evt & EVT_BUTTON)
     {
       if (bLogging)
       {
         bLogging = 0;
+        trig_armed = 0;
+        can_capture_stop();
+        ser_capture_stop();
+        extChannelDisable(&EXTD1, SER_PPS_CHANNEL);
+        if (awd_window > 0)
+        {
+          // back to plain sampling
+          awd_capturing = 0;
+          adc_restart();
+        }
         
-        // we are in logging state -- should write the rest of log
-        request_write();
+        // we are in logging state -- should write the rest of log,
+        // the formatter drains the sample queue first
+        bReqClose = 1;
+        bReqFlush = 1;
+        chBSemSignal(&sample_queue_sem);
       }
       else
       {
@@ -577,11 +2492,30 @@ INDICATE_IDLE_ON();
         {
           if (read_config_file()) // trying to read configuration file
           {
+            adc_restart(); // sample times and oversampling may have changed
+            
             // all done -- start loging
             start_log();
+            
+            // CAN and serial frames are stamped against the log start, so after it
+            if (!can_capture_start(&sample_queue_sem))
+              palSetPad(GPIOB, GPIOB_PIN13_LED_R); // bit rate not possible, voltages only
+            if (ser_gps_pps)
+              extChannelEnable(&EXTD1, SER_PPS_CHANNEL);
+            ser_capture_start(&sample_queue_sem);
+            
+            if (awd_window > 0)
+            {
+              // nothing is sampled until the first watchdog event
+              gptStopTimer(&GPTD4);
+              awd_capturing = 0;
+              awd_event = 0;
+              adc_watch();
+            }
           }
           else
           {
+            adc_restart(); // a config applied without a sample line stopped it
             palSetPad(GPIOB, GPIOB_PIN13_LED_R);
             palSetPad(GPIOB, GPIOB_PIN14_LED_B);
           }
@@ -590,32 +2524,27 @@ INDICATE_IDLE_ON();
           palSetPad(GPIOB, GPIOB_PIN13_LED_R);
       }
     }
-    bButtonPrev = bButton;  
-    
-    // this loop is going very fast, so the button filtering is needed
-    bButtonNew = palReadPad(GPIOC, GPIOC_PIN6_BTN);
-    if (bButtonNew && bButton == 0)
+
+    // the console works on the card and the configuration through this loop
+    if (evt & EVT_CONSOLE)
     {
-      iButtonStableCounter++;
-      if (iButtonStableCounter > BUTTON_COUNTER_THRESHOLD)
+      if (bLogging)
       {
-        iButtonStableCounter = 0;
-        bButton = 1;
+        // the channel settings switch between two ADC blocks, the rest applies at the next start
+        console_result = console_req == CON_REQ_MOUNT ? 1 : config_reload_live();
       }
-    }
-    else
-    if (bButtonNew == 0 && bButton)
-    {
-      iButtonStableCounter++;
-      if (iButtonStableCounter > BUTTON_COUNTER_THRESHOLD)
+      else
       {
-        iButtonStableCounter = 0;
-        bButton = 0;
+        console_result = SDCD1.state == BLK_READY || init_sd();
+        if (console_result && console_req == CON_REQ_RELOAD)
+        {
+          console_result = read_config_file();
+          adc_restart();
+        }
       }
+      chBSemSignal(&console_done_sem);
     }
-    else
-      iButtonStableCounter = 0;
-    
+
     if (bWriteFault)
       palSetPad(GPIOB, GPIOB_PIN13_LED_R);
 
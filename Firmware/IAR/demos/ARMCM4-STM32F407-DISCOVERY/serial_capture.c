@@ -0,0 +1,365 @@
+/*===========================================================================*/
+// serial sensor capture, see serial_capture.h
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "serial_capture.h"
+#include "ccm.h"
+#include "timebase.h"
+
+ser_port_config_t ser_port_config[SER_PORTS];
+const uint8_t ser_port_number[SER_PORTS] = {1, 2, 3, 6};
+uint8_t ser_gps_port = 0;
+uint8_t ser_gps_pps = 0;
+uint32_t ser_frames = 0;
+uint32_t ser_ring_drops = 0;
+uint32_t ser_errors = 0;
+
+typedef struct
+{
+  UARTDriver *uartp;
+  ioportid_t rx_port;
+  uint8_t rx_pad;
+  uint8_t rx_af;
+} ser_hw_t;
+
+static const ser_hw_t ser_hw[SER_PORTS] =
+{
+  {&UARTD1, GPIOB, GPIOB_PIN7_USART1_RX, 7},
+  {&UARTD2, GPIOD, GPIOD_PIN6_USART2_RX, 7},
+  {&UARTD3, GPIOD, GPIOD_PIN9_USART3_RX, 7},
+  {&UARTD6, GPIOC, GPIOC_PIN7_USART6_RX, 8},
+};
+
+// frame being collected, ISR of the port only
+typedef struct
+{
+  uint32_t rd;        // next byte of the DMA buffer to take
+  uint32_t char_x16;  // character time in 1/16 us
+  uint64_t start;     // timebase time of the first byte
+  uint16_t length;
+  uint8_t data[SER_FRAME_MAX];
+} ser_state_t;
+
+// DMA buffers and port state in SRAM
+static uint8_t ser_dma_buf[SER_PORTS][SER_DMA_SIZE];
+static ser_state_t ser_state[SER_PORTS];
+static UARTConfig ser_uart_config[SER_PORTS];
+
+// single producer: all USART and their DMA ISRs have the same priority and
+// never preempt each other; single consumer: the formatter (CCM)
+CCM_RAM static ser_record_t ser_ring[SER_RING_DEPTH];
+static volatile uint32_t ser_ring_head = 0; // written by the ISRs only
+static volatile uint32_t ser_ring_tail = 0; // written by the formatter only
+static BinarySemaphore *ser_wake;
+static uint8_t ser_running = 0; // bit mask of the started ports
+
+static volatile uint64_t ser_pps_stamp = 0;
+static volatile uint32_t ser_pps_count = 0;
+static uint32_t ser_pps_used = 0; // formatter only
+
+void ser_capture_defaults(void)
+{
+  int i;
+  
+  for (i = 0; i < SER_PORTS; i++)
+  {
+    ser_port_config[i].baud = 0;
+    ser_port_config[i].mode = SER_FRAME_LINE;
+  }
+  ser_gps_port = 0;
+  ser_gps_pps = 0;
+}
+
+int ser_port_index(int usart)
+{
+  int i;
+  
+  for (i = 0; i < SER_PORTS; i++)
+    if (ser_port_number[i] == usart) return i;
+  return -1;
+}
+
+static int ser_index(UARTDriver *uartp)
+{
+  int i;
+  
+  for (i = 0; i < SER_PORTS - 1; i++)
+    if (ser_hw[i].uartp == uartp) break;
+  return i;
+}
+
+// ISR: the collected frame of port i goes into the ring
+static void ser_push(int i)
+{
+  ser_state_t *s = &ser_state[i];
+  uint32_t head = ser_ring_head;
+  ser_record_t *r;
+  
+  ser_frames++;
+  if (head - ser_ring_tail >= SER_RING_DEPTH)
+  {
+    ser_ring_drops++;
+  }
+  else
+  {
+    r = &ser_ring[head & (SER_RING_DEPTH - 1)];
+    r->stamp = s->start;
+    r->port = ser_port_number[i];
+    r->mode = ser_port_config[i].mode;
+    r->length = s->length;
+    memcpy(r->data, s->data, s->length);
+    ser_ring_head = head + 1;
+  
+    // NMEA at 1 Hz can wait for the next sample, a chatty bus can not
+    if (head + 1 - ser_ring_tail == SER_RING_WAKE)
+    {
+      chSysLockFromIsr();
+      chBSemSignalI(ser_wake);
+      chSysUnlockFromIsr();
+    }
+  }
+  s->length = 0;
+}
+
+// ISR: takes the bytes the DMA wrote since the last call; late is the number
+// of character times between the last of them and now, idle marks the end
+// of a burst
+static void ser_drain(UARTDriver *uartp, uint32_t late, int idle)
+{
+  int i = ser_index(uartp);
+  ser_state_t *s = &ser_state[i];
+  uint32_t pos, n, k;
+  uint64_t now;
+  uint8_t b;
+  
+  chSysLockFromIsr();
+  now = timebase_nowI();
+  chSysUnlockFromIsr();
+  
+  pos = (SER_DMA_SIZE - dmaStreamGetTransactionSize(uartp->dmarx)) & (SER_DMA_SIZE - 1);
+  n = (pos - s->rd) & (SER_DMA_SIZE - 1);
+  for (k = 0; k < n; k++)
+  {
+    b = ser_dma_buf[i][(s->rd + k) & (SER_DMA_SIZE - 1)];
+    if (s->length == 0)
+      s->start = now - (((n - 1 - k + late) * s->char_x16) >> 4);
+  
+    if (b == '\n' && ser_port_config[i].mode == SER_FRAME_LINE)
+    {
+      if (s->length > 0 && s->data[s->length - 1] == '\r')
+        s->length--;
+      if (s->length > 0)
+        ser_push(i);
+      continue;
+    }
+  
+    s->data[s->length++] = b;
+    if (s->length == SER_FRAME_MAX)
+      ser_push(i);
+  }
+  s->rd = pos;
+  
+  if (idle && s->length > 0 && ser_port_config[i].mode == SER_FRAME_IDLE)
+    ser_push(i);
+}
+
+static void ser_rxend_cb(UARTDriver *uartp)
+{
+  ser_drain(uartp, 0, 0);
+}
+
+static void ser_rxidle_cb(UARTDriver *uartp)
+{
+  ser_drain(uartp, 1, 1);
+}
+
+static void ser_rxerr_cb(UARTDriver *uartp, uartflags_t e)
+{
+  (void)uartp;
+  (void)e;
+  ser_errors++;
+}
+
+void ser_capture_start(BinarySemaphore *wake)
+{
+  int i;
+  
+  ser_wake = wake;
+  ser_ring_head = 0;
+  ser_ring_tail = 0;
+  ser_frames = 0;
+  ser_ring_drops = 0;
+  ser_errors = 0;
+  ser_pps_used = ser_pps_count; // only pulses from now on
+  
+  for (i = 0; i < SER_PORTS; i++)
+  {
+    if (ser_port_config[i].baud == 0) continue;
+  
+    ser_state[i].rd = 0;
+    ser_state[i].length = 0;
+    ser_state[i].char_x16 = 160000000UL / ser_port_config[i].baud; // 10 bits
+  
+    memset(&ser_uart_config[i], 0, sizeof(UARTConfig));
+    ser_uart_config[i].rxend_cb = ser_rxend_cb;
+    ser_uart_config[i].rxerr_cb = ser_rxerr_cb;
+    ser_uart_config[i].rxidle_cb = ser_rxidle_cb;
+    ser_uart_config[i].speed = ser_port_config[i].baud;
+  
+    palSetPadMode(ser_hw[i].rx_port, ser_hw[i].rx_pad, PAL_MODE_ALTERNATE(ser_hw[i].rx_af));
+    uartStart(ser_hw[i].uartp, &ser_uart_config[i]);
+    uartSTM32StartReceiveCircular(ser_hw[i].uartp, SER_DMA_SIZE, ser_dma_buf[i]);
+    ser_running |= 1 << i;
+  }
+}
+
+void ser_capture_stop(void)
+{
+  int i;
+  
+  for (i = 0; i < SER_PORTS; i++)
+  {
+    if (!(ser_running & (1 << i))) continue;
+  
+    uartStopReceive(ser_hw[i].uartp);
+    uartStop(ser_hw[i].uartp);
+    palSetPadMode(ser_hw[i].rx_port, ser_hw[i].rx_pad, PAL_MODE_INPUT_PULLUP);
+  }
+  ser_running = 0;
+}
+
+const ser_record_t *ser_capture_peek(void)
+{
+  uint32_t tail = ser_ring_tail;
+  
+  if (tail == ser_ring_head) return 0;
+  return &ser_ring[tail & (SER_RING_DEPTH - 1)];
+}
+
+void ser_capture_pop(void)
+{
+  ser_ring_tail = ser_ring_tail + 1;
+}
+
+void ser_pps_cb(EXTDriver *extp, expchannel_t channel)
+{
+  (void)extp;
+  (void)channel;
+  
+  chSysLockFromIsr();
+  ser_pps_stamp = timebase_nowI();
+  ser_pps_count++;
+  chSysUnlockFromIsr();
+}
+
+/*===========================================================================*/
+// NMEA
+
+static int two_digits(const char *p)
+{
+  if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') return -1;
+  return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+// days since 1970-01-01 of a date of the proleptic Gregorian calendar
+static int32_t days_from_civil(int32_t y, int32_t m, int32_t d)
+{
+  int32_t era, yoe, doy, doe;
+  
+  y -= m <= 2;
+  era = y / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// "$xxRMC,hhmmss.sss,A,lat,N,lon,E,speed,course,ddmmyy,..*CS" of any talker
+// with a valid fix and checksum; returns 1 and the UTC time (unix us) in
+// *utc_us, the fraction of the second in *frac_us
+static int nmea_rmc(const ser_record_t *r, uint64_t *utc_us, uint32_t *frac_us)
+{
+  char s[SER_FRAME_MAX + 1];
+  char *f[9];
+  char *star;
+  int nf = 0, i;
+  int hh, mm, ss, dd, mo, yy;
+  uint32_t frac = 0, scale = 100000;
+  uint8_t sum = 0;
+  
+  if (r->length < 7 || r->data[0] != '$' || memcmp(r->data + 3, "RMC,", 4) != 0) return 0;
+  memcpy(s, r->data, r->length);
+  s[r->length] = 0;
+  
+  star = strchr(s, '*');
+  if (star == 0) return 0;
+  for (i = 1; s + i < star; i++)
+    sum ^= (uint8_t)s[i];
+  if (strtoul(star + 1, 0, 16) != sum) return 0;
+  *star = 0;
+  
+  for (i = 0; s[i] && nf < 9; i++)
+  {
+    if (s[i] == ',')
+    {
+      s[i] = 0;
+      f[nf++] = &s[i + 1];
+    }
+  }
+  // f[0] time, f[1] status, f[8] date
+  if (nf < 9 || f[1][0] != 'A' || strlen(f[8]) != 6) return 0;
+  
+  hh = two_digits(f[0]);
+  mm = hh < 0 ? -1 : two_digits(f[0] + 2);
+  ss = mm < 0 ? -1 : two_digits(f[0] + 4);
+  dd = two_digits(f[8]);
+  mo = dd < 0 ? -1 : two_digits(f[8] + 2);
+  yy = mo < 0 ? -1 : two_digits(f[8] + 4);
+  if (ss < 0 || yy < 0 || hh > 23 || mm > 59 || ss > 60 || mo < 1 || mo > 12 || dd < 1) return 0;
+  
+  if (f[0][6] == '.')
+  {
+    for (i = 7; f[0][i] >= '0' && f[0][i] <= '9' && scale > 0; i++)
+    {
+      frac += (f[0][i] - '0') * scale;
+      scale /= 10;
+    }
+  }
+  
+  *frac_us = frac;
+  *utc_us = ((uint64_t)days_from_civil(2000 + yy, mo, dd) * 86400 + hh * 3600 + mm * 60 + ss) * 1000000 + frac;
+  return 1;
+}
+
+int ser_gps_pair(const ser_record_t *r, uint64_t *utc_us, uint64_t *stamp)
+{
+  uint64_t pps;
+  uint32_t count, frac;
+  
+  if (ser_gps_port == 0 || r->port != ser_gps_port || r->mode != SER_FRAME_LINE) return 0;
+  if (!nmea_rmc(r, utc_us, &frac)) return 0;
+  
+  if (!ser_gps_pps)
+  {
+    // the receiver sends the sentence some ms after the second, the host
+    // averages that out, constant offset aside
+    *stamp = r->stamp;
+    return 1;
+  }
+  
+  chSysLock();
+  pps = ser_pps_stamp;
+  count = ser_pps_count;
+  chSysUnlock();
+  
+  // the pulse of this second: new, and the sentence follows it within 1 s
+  if (count == ser_pps_used || frac != 0 || r->stamp < pps || r->stamp - pps >= 1000000) return 0;
+  ser_pps_used = count;
+  *stamp = pps;
+  return 1;
+}
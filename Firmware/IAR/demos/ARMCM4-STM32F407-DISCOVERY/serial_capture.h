@@ -0,0 +1,79 @@
+/*===========================================================================*/
+// serial sensor capture: the receivers of USART1/2/3/6 run a circular DMA
+// into a small buffer each, the half/full buffer and idle line interrupts
+// cut the bytes into frames (no interrupt per byte), which go into a frame
+// ring with the timebase time of their first byte; the formatter takes them
+// out in time order between the sample records
+//
+// Only the RX pins are used (PB7, PD6, PD9, PC7): GPS receivers and RS-485
+// buses are listened to, never driven. The time of a frame is worked back
+// from the interrupt time at 10 bit times per byte, exact for back-to-back
+// bytes, otherwise the idle line interrupt splits the burst anyway.
+//
+// A GPS on one of the ports with its PPS output on PD13 gives (UTC, timebase)
+// pairs: the $GPRMC/$GNRMC of a valid fix names the second its pulse started.
+
+#ifndef _SERIAL_CAPTURE_H_
+#define _SERIAL_CAPTURE_H_
+
+#include "ch.h"
+#include "hal.h"
+
+#define SER_PORTS           4   // USART1, USART2, USART3, USART6
+#define SER_DMA_SIZE        128 // receive buffer of a port, bytes, must be power of 2
+#define SER_FRAME_MAX       120 // longer frames are split
+#define SER_RING_DEPTH      16  // frames, must be power of 2
+#define SER_RING_WAKE       4   // the formatter is woken up at this fill
+
+#define SER_FRAME_LINE      0   // text up to '\n', the line end is not kept
+#define SER_FRAME_IDLE      1   // binary, up to a gap of one character time
+
+#define SER_PPS_CHANNEL     13  // EXT channel of the GPS PPS input (PD13)
+
+typedef struct
+{
+  uint64_t stamp;   // timebase microseconds of the first byte
+  uint8_t port;     // USART number
+  uint8_t mode;     // SER_FRAME_xxx
+  uint16_t length;
+  uint8_t data[SER_FRAME_MAX];
+} ser_record_t;
+
+typedef struct
+{
+  uint32_t baud;    // 0 - port not captured
+  uint8_t mode;     // SER_FRAME_xxx
+} ser_port_config_t;
+
+extern ser_port_config_t ser_port_config[SER_PORTS];
+extern const uint8_t ser_port_number[SER_PORTS]; // USART number of each entry
+extern uint8_t ser_gps_port;     // USART number of the GPS, 0 - none
+extern uint8_t ser_gps_pps;      // 1 - its PPS output is on PD13
+extern uint32_t ser_frames;      // received since ser_capture_start()
+extern uint32_t ser_ring_drops;  // lost because the formatter fell behind
+extern uint32_t ser_errors;      // framing, noise and overrun errors
+
+// all ports off, no GPS
+void ser_capture_defaults(void);
+
+// entry of USART number usart in ser_port_config or -1
+int ser_port_index(int usart);
+
+// starts the configured ports, wake is signalled when the ring fills up
+void ser_capture_start(BinarySemaphore *wake);
+void ser_capture_stop(void);
+
+// oldest frame in the ring or 0, formatter only; it stays there until
+// ser_capture_pop()
+const ser_record_t *ser_capture_peek(void);
+void ser_capture_pop(void);
+
+// EXT callback of the PPS input
+void ser_pps_cb(EXTDriver *extp, expchannel_t channel);
+
+// formatter: returns 1 if r is the RMC sentence of a valid fix from the GPS
+// port that can be paired, *utc_us gets the UTC time (unix us) at timebase
+// time *stamp: the last PPS edge with gps_pps, else the start of the sentence
+int ser_gps_pair(const ser_record_t *r, uint64_t *utc_us, uint64_t *stamp);
+
+#endif /* _SERIAL_CAPTURE_H_ */
@@ -0,0 +1,56 @@
+/*===========================================================================*/
+// free-running microsecond timebase on the 32-bit TIM5
+//
+// TIM5 counts up to 0xFFFFFFFF at 1 MHz, the update interrupt (every ~71 min)
+// extends the counter to 64 bits, so every timestamp is a single register read
+
+#include "ch.h"
+#include "hal.h"
+
+#include "timebase.h"
+
+static volatile uint32_t timebase_hi = 0;
+
+static void timebase_overflow_cb(GPTDriver *gptp)
+{
+  (void)gptp;
+  timebase_hi++;
+}
+
+static const GPTConfig timebase_config = 
+{
+  TIMEBASE_FREQUENCY,
+  timebase_overflow_cb
+};
+
+void timebase_init(void)
+{
+  timebase_hi = 0;
+  
+  gptStart(&TIMEBASE_GPT, &timebase_config);
+  gptStartContinuous(&TIMEBASE_GPT, 0); // ARR = 0xFFFFFFFF
+}
+
+uint64_t timebase_nowI(void)
+{
+  uint32_t hi = timebase_hi;
+  uint32_t lo = TIMEBASE_GPT.tim->CNT;
+  
+  // overflow happened but its interrupt is not served yet (we are either
+  // locked or inside an ISR of higher or equal priority)
+  if ((TIMEBASE_GPT.tim->SR & STM32_TIM_SR_UIF) && (lo < 0x80000000))
+    hi++;
+  
+  return ((uint64_t)hi << 32) | lo;
+}
+
+uint64_t timebase_now(void)
+{
+  uint64_t t;
+  
+  chSysLock();
+  t = timebase_nowI();
+  chSysUnlock();
+  
+  return t;
+}
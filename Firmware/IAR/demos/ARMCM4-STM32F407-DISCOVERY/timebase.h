@@ -0,0 +1,14 @@
+/*===========================================================================*/
+// free-running microsecond timebase on the 32-bit TIM5
+
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#define TIMEBASE_GPT        GPTD5
+#define TIMEBASE_FREQUENCY  1000000 // 1 tick = 1 us
+
+void timebase_init(void);
+uint64_t timebase_nowI(void); // from ISR or with the system locked
+uint64_t timebase_now(void);
+
+#endif /* _TIMEBASE_H_ */
@@ -0,0 +1,330 @@
+/*===========================================================================*/
+// encoder for the binary log format, see vlog_format.h
+//
+// Runs in the formatter thread: per channel first-order delta, zigzag and
+// varint into fixed size frames, typically 1-2 bytes per value instead of
+// ~9 ASCII characters
+
+#include <string.h>
+
+#include "vlog_bin.h"
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  return p + 2;
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+  return p + 4;
+}
+
+static uint8_t *put_u64(uint8_t *p, uint64_t v)
+{
+  p = put_u32(p, (uint32_t)v);
+  return put_u32(p, (uint32_t)(v >> 32));
+}
+
+static uint8_t *put_f32(uint8_t *p, float v)
+{
+  uint32_t u;
+  
+  memcpy(&u, &v, sizeof(u));
+  return put_u32(p, u);
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+  while (v >= 0x80)
+  {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static uint8_t *put_rec_header(uint8_t *p, uint8_t type, uint16_t length)
+{
+  *p++ = VLOG_SYNC;
+  *p++ = type;
+  return put_u16(p, length);
+}
+
+//------------------------------------------------------------------------------
+void vlog_frame_init(vlog_frame_t *f, uint8_t channels, uint32_t period_us)
+{
+  f->channels = channels;
+  f->period_us = period_us;
+  f->count = 0;
+  f->length = 0;
+}
+
+void vlog_frame_add(vlog_frame_t *f, uint32_t sample_no, uint64_t time_us, const uint16_t *values)
+{
+  uint8_t *p;
+  int i;
+  
+  if (f->count == 0)
+  {
+    // the record header is completed in vlog_frame_close()
+    p = f->buf + VLOG_REC_HEADER_SIZE;
+    p = put_u32(p, sample_no);
+    p = put_u64(p, time_us);
+    p = put_u16(p, 0); // sample count, patched on close
+    for (i = 0; i < f->channels; i++)
+      p = put_u16(p, values[i]);
+  }
+  else
+  {
+    p = f->buf + f->length;
+    p = put_varint(p, VLOG_ZIGZAG((int32_t)(time_us - f->prev_time) - (int32_t)f->period_us));
+    for (i = 0; i < f->channels; i++)
+      p = put_varint(p, VLOG_ZIGZAG((int32_t)values[i] - (int32_t)f->prev_value[i]));
+  }
+  
+  memcpy(f->prev_value, values, f->channels * sizeof(uint16_t));
+  f->prev_time = time_us;
+  f->length = (uint16_t)(p - f->buf);
+  f->count++;
+}
+
+// completes the frame record in f->buf, returns its size (0 if the frame is
+// empty) and starts a new frame
+uint16_t vlog_frame_close(vlog_frame_t *f)
+{
+  uint16_t length = f->length;
+  
+  if (f->count == 0)
+    return 0;
+  
+  put_rec_header(f->buf, VLOG_REC_FRAME, length - VLOG_REC_HEADER_SIZE);
+  put_u16(f->buf + VLOG_REC_HEADER_SIZE + 12, f->count);
+  
+  f->count = 0;
+  f->length = 0;
+  
+  return length;
+}
+
+//------------------------------------------------------------------------------
+void vlog_index_init(vlog_index_t *idx)
+{
+  idx->stride = 1;
+  idx->frames = 0;
+  idx->count = 0;
+}
+
+// called for every frame written, keeps at most VLOG_INDEX_MAX entries by
+// dropping every second one and doubling the stride when the table is full
+void vlog_index_add(vlog_index_t *idx, uint32_t sample_no, uint32_t offset)
+{
+  int i;
+  
+  if ((idx->frames++ % idx->stride) != 0)
+    return;
+  
+  if (idx->count == VLOG_INDEX_MAX)
+  {
+    for (i = 0; i < VLOG_INDEX_MAX / 2; i++)
+    {
+      idx->entry[i][0] = idx->entry[i * 2][0];
+      idx->entry[i][1] = idx->entry[i * 2][1];
+    }
+    idx->count = VLOG_INDEX_MAX / 2;
+    idx->stride *= 2;
+    
+    // this frame is on the new grid only if the frame counter says so
+    if (((idx->frames - 1) % idx->stride) != 0)
+      return;
+  }
+  
+  idx->entry[idx->count][0] = sample_no;
+  idx->entry[idx->count][1] = offset;
+  idx->count++;
+}
+
+//------------------------------------------------------------------------------
+uint16_t vlog_put_header(uint8_t *dst, uint8_t channel_mask, uint32_t period_us,
+                         const float *zero, const float *gain, const float *filt)
+{
+  uint8_t *p = dst + VLOG_REC_HEADER_SIZE;
+  int i;
+  
+  p = put_u32(p, VLOG_MAGIC);
+  p = put_u16(p, VLOG_VERSION);
+  p = put_u16(p, VLOG_FRAME_SAMPLES);
+  p = put_u32(p, period_us);
+  *p++ = channel_mask;
+  *p++ = VLOG_VALUE_FRAC_BITS;
+  p = put_u16(p, 0);
+  
+  for (i = 0; i < VLOG_MAX_CHANNELS; i++)
+  {
+    if (channel_mask & (1 << i))
+    {
+      p = put_f32(p, zero[i]);
+      p = put_f32(p, gain[i]);
+      p = put_f32(p, filt[i]);
+    }
+  }
+  
+  put_rec_header(dst, VLOG_REC_FILE_HEADER, (uint16_t)(p - dst - VLOG_REC_HEADER_SIZE));
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_calib(uint8_t *dst, uint8_t channel, uint8_t kind, uint8_t count, const float *p)
+{
+  uint8_t *q;
+  int n = (kind == VLOG_CALIB_POLY) ? count : count * 2;
+  int i;
+  
+  q = put_rec_header(dst, VLOG_REC_CALIB, (uint16_t)(4 + n * 4));
+  *q++ = channel;
+  *q++ = kind;
+  *q++ = count;
+  *q++ = 0;
+  for (i = 0; i < n; i++)
+    q = put_f32(q, p[i]);
+  return (uint16_t)(q - dst);
+}
+
+uint16_t vlog_put_rtc(uint8_t *dst, uint64_t rtc_us, uint64_t time_us)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_RTC, 16);
+  
+  p = put_u64(p, rtc_us);
+  p = put_u64(p, time_us);
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_trigger(uint8_t *dst, uint64_t time_us)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_TRIGGER, 8);
+  
+  p = put_u64(p, time_us);
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_config(uint8_t *dst, uint64_t time_us, uint32_t version, uint8_t channel_mask,
+                         const float *zero, const float *gain, const float *filt)
+{
+  uint8_t *p = dst + VLOG_REC_HEADER_SIZE;
+  int i;
+  
+  p = put_u64(p, time_us);
+  p = put_u32(p, version);
+  *p++ = channel_mask;
+  *p++ = 0;
+  p = put_u16(p, 0);
+  
+  for (i = 0; i < VLOG_MAX_CHANNELS; i++)
+  {
+    if (channel_mask & (1 << i))
+    {
+      p = put_f32(p, zero[i]);
+      p = put_f32(p, gain[i]);
+      p = put_f32(p, filt[i]);
+    }
+  }
+  
+  put_rec_header(dst, VLOG_REC_CONFIG, (uint16_t)(p - dst - VLOG_REC_HEADER_SIZE));
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_can(uint8_t *dst, uint64_t time_us, uint32_t id, uint8_t bus, uint8_t dlc, const uint8_t *data)
+{
+  uint8_t n = (id & VLOG_CAN_RTR) ? 0 : (dlc > 8 ? 8 : dlc);
+  uint8_t *p = put_rec_header(dst, VLOG_REC_CAN, 14 + n);
+  
+  p = put_u64(p, time_us);
+  p = put_u32(p, id);
+  *p++ = bus;
+  *p++ = dlc;
+  memcpy(p, data, n);
+  p += n;
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_serial(uint8_t *dst, uint64_t time_us, uint8_t port, uint8_t mode, uint16_t length, const uint8_t *data)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_SERIAL, 10 + length);
+  
+  p = put_u64(p, time_us);
+  *p++ = port;
+  *p++ = mode;
+  memcpy(p, data, length);
+  p += length;
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_gps(uint8_t *dst, uint64_t utc_us, uint64_t time_us)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_GPS, 16);
+  
+  p = put_u64(p, utc_us);
+  p = put_u64(p, time_us);
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_index(uint8_t *dst, const vlog_index_t *idx)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_INDEX, 4 + idx->count * 8);
+  int i;
+  
+  p = put_u32(p, idx->stride);
+  for (i = 0; i < idx->count; i++)
+  {
+    p = put_u32(p, idx->entry[i][0]);
+    p = put_u32(p, idx->entry[i][1]);
+  }
+  return (uint16_t)(p - dst);
+}
+
+// length is the full record size and must be at least VLOG_REC_HEADER_SIZE
+uint16_t vlog_put_pad(uint8_t *dst, uint16_t length)
+{
+  put_rec_header(dst, VLOG_REC_PAD, length - VLOG_REC_HEADER_SIZE);
+  memset(dst + VLOG_REC_HEADER_SIZE, 0, length - VLOG_REC_HEADER_SIZE);
+  return length;
+}
+
+uint16_t vlog_put_end(uint8_t *dst, uint32_t index_offset)
+{
+  uint8_t *p = put_rec_header(dst, VLOG_REC_END, 8);
+  
+  p = put_u32(p, index_offset);
+  p = put_u32(p, VLOG_END_MAGIC);
+  return (uint16_t)(p - dst);
+}
+
+/*===========================================================================*/
+// sidecar index
+
+uint16_t vlog_put_idx_header(uint8_t *dst, uint32_t every)
+{
+  uint8_t *p = dst;
+  
+  p = put_u32(p, VLOG_IDX_MAGIC);
+  p = put_u16(p, VLOG_VERSION);
+  p = put_u16(p, VLOG_IDX_ENTRY_SIZE);
+  p = put_u32(p, every);
+  p = put_u32(p, 0);
+  return (uint16_t)(p - dst);
+}
+
+uint16_t vlog_put_idx_entry(uint8_t *dst, uint32_t sample_no, uint32_t offset, uint64_t time_us)
+{
+  uint8_t *p = dst;
+  
+  p = put_u32(p, sample_no);
+  p = put_u32(p, offset);
+  p = put_u64(p, time_us);
+  return (uint16_t)(p - dst);
+}
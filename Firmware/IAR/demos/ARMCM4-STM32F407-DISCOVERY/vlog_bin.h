@@ -0,0 +1,54 @@
+/*===========================================================================*/
+// encoder for the binary log format, see vlog_format.h
+
+#ifndef _VLOG_BIN_H_
+#define _VLOG_BIN_H_
+
+#include "vlog_format.h"
+
+#define VLOG_INDEX_MAX  512 // entries kept in RAM, the stride doubles when full
+
+typedef struct
+{
+  uint8_t  buf[VLOG_FRAME_MAX_SIZE(VLOG_MAX_CHANNELS)];
+  uint16_t length;      // bytes used in buf
+  uint16_t count;       // samples in the frame
+  uint8_t  channels;    // enabled channels
+  uint32_t period_us;   // nominal sample period, time deltas are coded against it
+  uint64_t prev_time;
+  uint16_t prev_value[VLOG_MAX_CHANNELS];
+} vlog_frame_t;
+
+typedef struct
+{
+  uint32_t stride;      // frames between entries
+  uint32_t frames;      // frames seen so far
+  uint16_t count;
+  uint32_t entry[VLOG_INDEX_MAX][2]; // first sample number, file offset
+} vlog_index_t;
+
+void vlog_frame_init(vlog_frame_t *f, uint8_t channels, uint32_t period_us);
+void vlog_frame_add(vlog_frame_t *f, uint32_t sample_no, uint64_t time_us, const uint16_t *values);
+uint16_t vlog_frame_close(vlog_frame_t *f);
+
+void vlog_index_init(vlog_index_t *idx);
+void vlog_index_add(vlog_index_t *idx, uint32_t sample_no, uint32_t offset);
+
+uint16_t vlog_put_header(uint8_t *dst, uint8_t channel_mask, uint32_t period_us,
+                         const float *zero, const float *gain, const float *filt);
+uint16_t vlog_put_calib(uint8_t *dst, uint8_t channel, uint8_t kind, uint8_t count, const float *p);
+uint16_t vlog_put_trigger(uint8_t *dst, uint64_t time_us);
+uint16_t vlog_put_config(uint8_t *dst, uint64_t time_us, uint32_t version, uint8_t channel_mask,
+                         const float *zero, const float *gain, const float *filt);
+uint16_t vlog_put_can(uint8_t *dst, uint64_t time_us, uint32_t id, uint8_t bus, uint8_t dlc, const uint8_t *data);
+uint16_t vlog_put_serial(uint8_t *dst, uint64_t time_us, uint8_t port, uint8_t mode, uint16_t length, const uint8_t *data);
+uint16_t vlog_put_rtc(uint8_t *dst, uint64_t rtc_us, uint64_t time_us);
+uint16_t vlog_put_gps(uint8_t *dst, uint64_t utc_us, uint64_t time_us);
+uint16_t vlog_put_index(uint8_t *dst, const vlog_index_t *idx);
+uint16_t vlog_put_pad(uint8_t *dst, uint16_t length);
+uint16_t vlog_put_end(uint8_t *dst, uint32_t index_offset);
+
+uint16_t vlog_put_idx_header(uint8_t *dst, uint32_t every);
+uint16_t vlog_put_idx_entry(uint8_t *dst, uint32_t sample_no, uint32_t offset, uint64_t time_us);
+
+#endif /* _VLOG_BIN_H_ */
@@ -0,0 +1,123 @@
+/*===========================================================================*/
+// binary log format (.vlb), shared by the firmware and the host tools
+//
+// A file is a plain sequence of records, all integers are little-endian:
+//
+//   uint8  sync    VLOG_SYNC
+//   uint8  type    VLOG_REC_xxx
+//   uint16 length  payload bytes following this header
+//   ...    payload
+//
+// Readers skip record types they do not know. Sample values are the filtered
+// ADC codes in 12.4 fixed point (VLOG_VALUE_FRAC_BITS), so with chN_filt 1
+// they are exactly the raw 12-bit samples shifted left by 4 (channels with
+// a calibration curve hold the curve output quantized to the same range). Frames hold
+// VLOG_FRAME_SAMPLES samples: the first one verbatim, the rest as first-order
+// deltas, zigzag mapped and varint coded (7 bits per byte, LSB group first,
+// bit 7 set when more bytes follow). Every frame carries its first sample
+// number and time, so decoding can start at any frame.
+
+#ifndef _VLOG_FORMAT_H_
+#define _VLOG_FORMAT_H_
+
+#include <stdint.h>
+
+#define VLOG_SYNC               0xA5
+#define VLOG_REC_HEADER_SIZE    4
+
+#define VLOG_MAGIC              0x31424C56UL  // "VLB1"
+#define VLOG_END_MAGIC          0x45424C56UL  // "VLBE"
+#define VLOG_VERSION            1
+
+#define VLOG_FRAME_SAMPLES      128
+#define VLOG_MAX_CHANNELS       8
+#define VLOG_VALUE_FRAC_BITS    4
+
+// first record of the file
+//   uint32 magic, uint16 version, uint16 frame samples, uint32 sample period us,
+//   uint8 channel mask (bit 0 = ch #1), uint8 value fraction bits, uint16 0,
+//   then for every enabled channel: float zero, float gain, float filter order
+#define VLOG_REC_FILE_HEADER    'H'
+
+// uint32 first sample number, uint64 first sample time (us since log start),
+// uint16 sample count, uint16 first value of every enabled channel, then for
+// every further sample: varint zigzag(dt - period), varint zigzag(dvalue) per channel
+#define VLOG_REC_FRAME          'F'
+
+// uint64 RTC unix time us, uint64 timer us since log start
+#define VLOG_REC_RTC            'R'
+
+// frame index written when the log is closed: uint32 frames between entries,
+// then (uint32 first sample number, uint32 file offset of the frame record) pairs
+#define VLOG_REC_INDEX          'I'
+
+// always the last 12 bytes of a closed file: uint32 index record offset, uint32 VLOG_END_MAGIC
+#define VLOG_REC_END            'E'
+#define VLOG_REC_END_SIZE       12
+
+// start of a triggered capture (trig_mode), written before its first record:
+// uint64 trigger time (us since log start)
+#define VLOG_REC_TRIGGER        'T'
+
+// received CAN frame (can1_bitrate / can2_bitrate): uint64 time (us since log
+// start), uint32 identifier (bit 31 set: 29-bit, bit 30 set: remote frame),
+// uint8 bus (1 = CAN1), uint8 DLC, then the data bytes (none for remote frames);
+// written as the frames come in, so they are not in time order with the
+// samples of the frame records around them
+#define VLOG_REC_CAN            'N'
+#define VLOG_CAN_EXT            0x80000000UL
+#define VLOG_CAN_RTR            0x40000000UL
+#define VLOG_REC_CAN_MAX_SIZE   (VLOG_REC_HEADER_SIZE + 14 + 8)
+
+// received serial frame (serN_baud): uint64 time of its first byte (us since
+// log start), uint8 USART number, uint8 framing (0 = text line without the
+// line end, 1 = binary up to an idle line), then the bytes, at most 120;
+// not in time order with the frame records, like VLOG_REC_CAN
+#define VLOG_REC_SERIAL         'U'
+#define VLOG_REC_SERIAL_MAX_SIZE (VLOG_REC_HEADER_SIZE + 10 + 120)
+
+// GPS time pair (gps_port): uint64 UTC unix time us, uint64 timer us since
+// log start, same layout as VLOG_REC_RTC; with gps_pps the timer time is the
+// PPS edge of that UTC second
+#define VLOG_REC_GPS            'G'
+
+// channel settings changed while logging (cfg set / cfg reload), the records
+// from time on are calibrated with them: uint64 time (us since log start),
+// uint32 config version, uint8 channel mask (the one of the file header),
+// uint8 0, uint16 0, then for every enabled channel: float zero, float gain,
+// float filter order, as in the file header
+#define VLOG_REC_CONFIG         'K'
+#define VLOG_REC_CONFIG_MAX_SIZE (VLOG_REC_HEADER_SIZE + 16 + VLOG_MAX_CHANNELS * 12)
+
+// alignment filler, payload is ignored
+#define VLOG_REC_PAD            'P'
+
+// non-linear calibration of a channel, follows the file header; the header
+// already holds the effective zero/gain of the channel, this is for reference:
+//   uint8 channel (0 = ch #1), uint8 kind (1 cubic polynomial of the raw code,
+//   2 piecewise linear), uint8 count, uint8 0, then float c0..c3 or count (x, y) pairs
+#define VLOG_REC_CALIB          'C'
+#define VLOG_CALIB_POLY         1
+#define VLOG_CALIB_PWL          2
+#define VLOG_CALIB_MAX_POINTS   16
+#define VLOG_REC_CALIB_MAX_SIZE (VLOG_REC_HEADER_SIZE + 4 + VLOG_CALIB_MAX_POINTS * 8)
+
+// sidecar index (.idx next to every log file, any output but lz4), written while
+// logging so a time window can be found without reading the log:
+//   header  uint32 VLOG_IDX_MAGIC, uint16 VLOG_VERSION, uint16 entry size,
+//           uint32 records between entries (index_every), uint32 0
+//   entries uint32 sample number, uint32 file offset of the record (the CSV
+//           line or the .vlb frame holding the sample), uint64 time (us since
+//           log start); fixed size and in sample (and time) order
+#define VLOG_IDX_MAGIC          0x58444956UL  // "VIDX"
+#define VLOG_IDX_HEADER_SIZE    16
+#define VLOG_IDX_ENTRY_SIZE     16
+
+#define VLOG_ZIGZAG(v)    (((uint32_t)(v) << 1) ^ (uint32_t)((int32_t)(v) >> 31))
+#define VLOG_UNZIGZAG(u)  ((int32_t)((u) >> 1) ^ -(int32_t)((u) & 1))
+
+// largest frame record: header + fixed part + 5 bytes of time and 3 bytes per channel per sample
+#define VLOG_FRAME_MAX_SIZE(channels) \
+  (VLOG_REC_HEADER_SIZE + 14 + 2 * (channels) + (VLOG_FRAME_SAMPLES - 1) * (5 + 3 * (channels)))
+
+#endif /* _VLOG_FORMAT_H_ */
@@ -711,6 +711,146 @@ void clear_lock (	/* Clear lock entries of the volume */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Write a FAT/directory sector                                          */
+/*-----------------------------------------------------------------------*/
+
+#if !_FS_READONLY
+static
+FRESULT write_sector (	/* Write a FAT/directory sector, FAT sectors go to all FAT copies */
+	FATFS *fs,		/* File system object */
+	const BYTE *buf,	/* Sector data */
+	DWORD sect		/* Sector number */
+)
+{
+	if (disk_write(fs->drv, buf, sect, 1) != RES_OK)
+		return FR_DISK_ERR;
+	if (sect < (fs->fatbase + fs->fsize)) {	/* In FAT area */
+		BYTE nf;
+		for (nf = fs->n_fats; nf > 1; nf--) {	/* Reflect the change to all FAT copies */
+			sect += fs->fsize;
+			disk_write(fs->drv, buf, sect, 1);
+		}
+	}
+	return FR_OK;
+}
+#endif
+
+
+
+#if _FS_WINCACHE
+/*-----------------------------------------------------------------------*/
+/* Sector cache behind the window                                        */
+/*-----------------------------------------------------------------------*/
+/* Sectors leaving the window are kept in _FS_WINCACHE slots, dirty ones
+/  are written back on eviction (least recently used first) or on sync, so
+/  chain creation and directory updates do not write a sector per move. */
+
+static
+FRESULT cache_put (	/* Keep the window in the cache */
+	FATFS *fs		/* File system object */
+)
+{
+	UINT i, n = 0;
+
+
+	for (i = 0; i < _FS_WINCACHE; i++) {	/* Sector already in a slot? */
+		if (fs->csect[i] == fs->winsect) break;
+	}
+	if (i == _FS_WINCACHE) {				/* No, take an empty or the least recently used slot */
+		for (i = 0; i < _FS_WINCACHE; i++) {
+			if (!fs->csect[i]) break;
+			if (fs->cstamp[i] < fs->cstamp[n]) n = i;
+		}
+		if (i == _FS_WINCACHE) {
+			i = n;
+#if !_FS_READONLY
+			if (fs->cflag[i]) {				/* Write back the evicted sector */
+				if (write_sector(fs, fs->cbuf[i], fs->csect[i]) != FR_OK)
+					return FR_DISK_ERR;
+				fs->cflag[i] = 0;
+			}
+#endif
+		}
+		fs->csect[i] = fs->winsect;
+		mem_cpy(fs->cbuf[i], fs->win, SS(fs));
+	} else if (fs->wflag) {
+		mem_cpy(fs->cbuf[i], fs->win, SS(fs));
+	}
+#if !_FS_READONLY
+	fs->cflag[i] |= fs->wflag;
+	fs->wflag = 0;
+#endif
+	fs->cstamp[i] = ++fs->cnext;
+	return FR_OK;
+}
+
+
+static
+int cache_get (		/* Load a sector from the cache into the window, 1: hit */
+	FATFS *fs,		/* File system object */
+	DWORD sector	/* Sector number */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_WINCACHE; i++) {
+		if (fs->csect[i] == sector) {
+			mem_cpy(fs->win, fs->cbuf[i], SS(fs));
+			fs->cstamp[i] = ++fs->cnext;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+#if !_FS_READONLY
+static
+FRESULT cache_flush (	/* Write back all dirty slots, in sector order */
+	FATFS *fs		/* File system object */
+)
+{
+	UINT i, n;
+
+
+	for (;;) {
+		n = _FS_WINCACHE;
+		for (i = 0; i < _FS_WINCACHE; i++) {
+			if (fs->cflag[i] && (n == _FS_WINCACHE || fs->csect[i] < fs->csect[n])) n = i;
+		}
+		if (n == _FS_WINCACHE) break;
+		if (write_sector(fs, fs->cbuf[n], fs->csect[n]) != FR_OK)
+			return FR_DISK_ERR;
+		fs->cflag[n] = 0;
+	}
+	return FR_OK;
+}
+#endif
+
+
+static
+void cache_clear (	/* Forget all slots (mount) */
+	FATFS *fs		/* File system object */
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < _FS_WINCACHE; i++) {
+		fs->csect[i] = 0;
+#if !_FS_READONLY
+		fs->cflag[i] = 0;
+#endif
+		fs->cstamp[i] = 0;
+	}
+	fs->cnext = 0;
+}
+#endif	/* _FS_WINCACHE */
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Change window offset                                                  */
 /*-----------------------------------------------------------------------*/
@@ -726,18 +866,23 @@ FRESULT move_window (
 
 	wsect = fs->winsect;
 	if (wsect != sector) {	/* Changed current window */
+#if _FS_WINCACHE
+		if (wsect) {		/* Keep the window in the cache, write-back is deferred */
+			if (cache_put(fs) != FR_OK)
+				return FR_DISK_ERR;
+		}
+		if (sector) {
+			if (!cache_get(fs, sector) &&
+				disk_read(fs->drv, fs->win, sector, 1) != RES_OK)
+				return FR_DISK_ERR;
+			fs->winsect = sector;
+		}
+#else
 #if !_FS_READONLY
 		if (fs->wflag) {	/* Write back dirty window if needed */
-			if (disk_write(fs->drv, fs->win, wsect, 1) != RES_OK)
+			if (write_sector(fs, fs->win, wsect) != FR_OK)
 				return FR_DISK_ERR;
 			fs->wflag = 0;
-			if (wsect < (fs->fatbase + fs->fsize)) {	/* In FAT area */
-				BYTE nf;
-				for (nf = fs->n_fats; nf > 1; nf--) {	/* Reflect the change to all FAT copies */
-					wsect += fs->fsize;
-					disk_write(fs->drv, fs->win, wsect, 1);
-				}
-			}
 		}
 #endif
 		if (sector) {
@@ -745,6 +890,7 @@ FRESULT move_window (
 				return FR_DISK_ERR;
 			fs->winsect = sector;
 		}
+#endif
 	}
 
 	return FR_OK;
@@ -766,9 +912,13 @@ FRESULT sync (	/* FR_OK: successful, FR_DISK_ERR: failed */
 
 
 	res = move_window(fs, 0);
+#if _FS_WINCACHE
+	if (res == FR_OK)
+		res = cache_flush(fs);
+#endif
 	if (res == FR_OK) {
 		/* Update FSInfo sector if needed */
-		if (fs->fs_type == FS_FAT32 && fs->fsi_flag) {
+		if (fs->fs_type == FS_FAT32 && fs->fsi_flag == 1) {
 			fs->winsect = 0;
 			/* Create FSInfo structure */
 			mem_set(fs->win, 0, 512);
@@ -917,6 +1067,38 @@ FRESULT put_fat (
 
 
 
+#if _FS_FREEMAP && !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Free cluster map                                                      */
+/*-----------------------------------------------------------------------*/
+/* One bit per fm_ucl clusters (a whole number of FAT sectors), 0 means
+/  that there is no free cluster in the range. Bits start at 1 on mount,
+/  they are cleared by f_scanfree and by create_chain when it has been
+/  through a whole range, a freed cluster sets its bit again. */
+
+#define FM_BIT(fs, clst)	((clst) / (fs)->fm_ucl)
+#define FM_TEST(fs, clst)	((fs)->fm_map[FM_BIT(fs, clst) / 8] & (1 << (FM_BIT(fs, clst) % 8)))
+
+static
+void fm_mark (
+	FATFS *fs,		/* File system object */
+	DWORD clst,		/* A cluster in the range */
+	int has_free	/* 0: no free cluster in the range */
+)
+{
+	DWORD b = FM_BIT(fs, clst);
+
+
+	if (has_free)
+		fs->fm_map[b / 8] |= 1 << (b % 8);
+	else
+		fs->fm_map[b / 8] &= ~(1 << (b % 8));
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
 /*-----------------------------------------------------------------------*/
@@ -949,6 +1131,15 @@ FRESULT remove_chain (
 				fs->free_clust++;
 				fs->fsi_flag = 1;
 			}
+#if _FS_FREEMAP
+			if (fs->fm_ucl) {
+				fm_mark(fs, clst, 1);
+				if (clst < fs->fm_scan) {		/* Already counted by f_scanfree */
+					fs->fm_free++;
+					if (FM_BIT(fs, clst) == FM_BIT(fs, fs->fm_scan)) fs->fm_any = 1;
+				}
+			}
+#endif
 #if _USE_ERASE
 			if (ecl + 1 == nxt) {	/* Next cluster is contiguous */
 				ecl = nxt;
@@ -982,6 +1173,10 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 {
 	DWORD cs, ncl, scl;
 	FRESULT res;
+#if _FS_FREEMAP
+	DWORD ecl;
+	BYTE ent = 1, whole = 0;	/* Entering a map range, the range is being checked from its start */
+#endif
 
 
 	if (clst == 0) {		/* Create a new chain */
@@ -999,9 +1194,32 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 	for (;;) {
 		ncl++;							/* Next cluster */
 		if (ncl >= fs->n_fatent) {		/* Wrap around */
+#if _FS_FREEMAP
+			if (fs->fm_ucl && whole) fm_mark(fs, ncl - 1, 0);	/* The last range is all in use */
+			ent = whole = 1;
+#endif
 			ncl = 2;
 			if (ncl > scl) return 0;	/* No free cluster */
 		}
+#if _FS_FREEMAP
+		if (fs->fm_ucl) {
+			if (ncl % fs->fm_ucl == 0) {	/* Next range */
+				if (whole) fm_mark(fs, ncl - 1, 0);	/* The previous one is all in use */
+				ent = whole = 1;
+			}
+			if (ent) {
+				ent = 0;
+				if (!FM_TEST(fs, ncl)) {	/* No free cluster in this range, skip it */
+					ecl = (FM_BIT(fs, ncl) + 1) * fs->fm_ucl;
+					if (ecl > fs->n_fatent) ecl = fs->n_fatent;
+					if (scl >= ncl && scl < ecl) return 0;	/* Back at the start, no free cluster */
+					ncl = ecl - 1;
+					whole = 0;
+					continue;
+				}
+			}
+		}
+#endif
 		cs = get_fat(fs, ncl);			/* Get the cluster status */
 		if (cs == 0) break;				/* Found a free cluster */
 		if (cs == 0xFFFFFFFF || cs == 1)/* An error occurred */
@@ -1014,11 +1232,19 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 		res = put_fat(fs, clst, ncl);	/* Link it to the previous one if needed */
 	}
 	if (res == FR_OK) {
-		fs->last_clust = ncl;			/* Update FSINFO */
-		if (fs->free_clust != 0xFFFFFFFF) {
-			fs->free_clust--;
+		/* Update FSINFO, written on sync when the hint moves on to another FAT
+		   sector, else on close. The hint is kept even if the free count is not known */
+		if (ncl / (SS(fs) / 4) != fs->last_clust / (SS(fs) / 4))
 			fs->fsi_flag = 1;
-		}
+		else if (!fs->fsi_flag)
+			fs->fsi_flag = 2;
+		fs->last_clust = ncl;
+		if (fs->free_clust != 0xFFFFFFFF)
+			fs->free_clust--;
+#if _FS_FREEMAP
+		if (fs->fm_ucl && ncl < fs->fm_scan)	/* Already counted by f_scanfree */
+			fs->fm_free--;
+#endif
 	} else {
 		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
 	}
@@ -2144,13 +2370,30 @@ FRESULT chk_mounted (	/* FR_OK(0): successful, !=0: any error occurred */
 			LD_DWORD(fs->win+FSI_StrucSig) == 0x61417272) {
 				fs->last_clust = LD_DWORD(fs->win+FSI_Nxt_Free);
 				fs->free_clust = LD_DWORD(fs->win+FSI_Free_Count);
+				if (fs->free_clust > fs->n_fatent - 2)	/* Out of range, not known */
+					fs->free_clust = 0xFFFFFFFF;
 		}
 	}
+#if _FS_FREEMAP
+	fs->fm_ucl = 0;				/* No map on FAT12, its entries do not fit the sectors */
+	if (fmt != FS_FAT12) {
+		DWORD cps = SS(fs) / (fmt == FS_FAT16 ? 2 : 4);	/* FAT entries per sector */
+		DWORD nfs = (fs->n_fatent + cps - 1) / cps;		/* FAT sectors in use */
+		fs->fm_ucl = cps * ((nfs + _FS_FREEMAP - 1) / _FS_FREEMAP);
+		mem_set(fs->fm_map, 0xFF, sizeof fs->fm_map);	/* Not scanned, may have free clusters */
+		fs->fm_scan = 0;
+		fs->fm_free = 0;
+		fs->fm_any = 0;
+	}
+#endif
 #endif
 	fs->fs_type = fmt;		/* FAT sub-type */
 	fs->id = ++Fsid;		/* File system mount ID */
 	fs->winsect = 0;		/* Invalidate sector cache */
 	fs->wflag = 0;
+#if _FS_WINCACHE
+	cache_clear(fs);
+#endif
 #if _FS_RPATH
 	fs->cdir = 0;			/* Current directory (root dir) */
 #endif
@@ -2420,7 +2663,7 @@ FRESULT f_read (
 			if (cc) {							/* Read maximum contiguous sectors directly */
 				if (csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
 					cc = fp->fs->csize - csect;
-				if (disk_read(fp->fs->drv, rbuff, sect, (BYTE)cc) != RES_OK)
+				if (disk_read(fp->fs->drv, rbuff, sect, cc) != RES_OK)
 					ABORT(fp->fs, FR_DISK_ERR);
 #if !_FS_READONLY && _FS_MINIMIZE <= 2			/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if _FS_TINY
@@ -2532,9 +2775,23 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fp->fs);			/* When remaining bytes >= sector size, */
 			if (cc) {						/* Write maximum contiguous sectors directly */
+				UINT ncc = cc;				/* Sectors wanted */
 				if (csect + cc > fp->fs->csize)	/* Clip at cluster boundary */
 					cc = fp->fs->csize - csect;
-				if (disk_write(fp->fs->drv, wbuff, sect, (BYTE)cc) != RES_OK)
+				while (cc < ncc) {			/* Extend the burst over following clusters while they are contiguous */
+#if _USE_FASTSEEK
+					if (fp->cltbl)
+						clst = clmt_clust(fp, fp->fptr + cc * SS(fp->fs));
+					else
+#endif
+						clst = create_chain(fp->fs, fp->clust);	/* Follow or stretch, the next round gets the same cluster if it is not used here */
+					if (clst == 1) ABORT(fp->fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
+					if (clst != fp->clust + 1) break;	/* Fragment (or disk full), write what we have */
+					fp->clust = clst;
+					cc += (ncc - cc > fp->fs->csize) ? fp->fs->csize : ncc - cc;
+				}
+				if (disk_write(fp->fs->drv, wbuff, sect, cc) != RES_OK)
 					ABORT(fp->fs, FR_DISK_ERR);
 #if _FS_TINY
 				if (fp->fs->winsect - sect < cc) {	/* Refill sector cache if it gets invalidated by the direct write */
@@ -2650,7 +2907,15 @@ FRESULT f_close (
 	LEAVE_FF(fs, res);
 
 #else
-	res = f_sync(fp);		/* Flush cached data */
+	res = validate(fp->fs, fp->id);
+	if (res == FR_OK) {		/* FSInfo changes held back by create_chain go out now */
+		if (fp->fs->fsi_flag == 2) fp->fs->fsi_flag = 1;
+#if _FS_REENTRANT
+		unlock_fs(fp->fs, FR_OK);
+#endif
+	}
+	if (res == FR_OK)
+		res = f_sync(fp);	/* Flush cached data */
 #if _FS_SHARE
 	if (res == FR_OK) {		/* Decrement open counter */
 #if _FS_REENTRANT
@@ -3135,6 +3400,81 @@ FRESULT f_getfree (
 
 
 
+#if _FS_FREEMAP
+/*-----------------------------------------------------------------------*/
+/* Scan the FAT a few sectors at a time                                  */
+/*-----------------------------------------------------------------------*/
+/* Builds the free cluster map and the free cluster count in the
+/  background after mount; the count replaces FSInfo when done. FAT sectors
+/  are read into fm_buf, not through the window, so the scan does not push
+/  the working sectors out of the cache. */
+
+FRESULT f_scanfree (
+	const TCHAR *path,	/* Pointer to the logical drive number (root dir) */
+	UINT nsect,			/* Number of FAT sectors to scan in this call */
+	DWORD *nclst		/* Free clusters when the scan is complete, else 0xFFFFFFFF */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, cps, sect;
+	UINT i;
+	BYTE any, *buf;
+
+
+	res = chk_mounted(&path, &fs, 0);
+	if (res == FR_OK) {
+		*nclst = 0xFFFFFFFF;
+		if (!fs->fm_ucl) {				/* FAT12, small enough for f_getfree */
+			if (fs->free_clust <= fs->n_fatent - 2) *nclst = fs->free_clust;
+			LEAVE_FF(fs, FR_OK);
+		}
+		cps = SS(fs) / (fs->fs_type == FS_FAT16 ? 2 : 4);
+		while (nsect-- && fs->fm_scan < fs->n_fatent) {
+			clst = fs->fm_scan;
+			sect = fs->fatbase + clst / cps;
+			buf = fs->fm_buf;
+#if _FS_WINCACHE
+			for (i = 0; i < _FS_WINCACHE; i++) {	/* A cache slot may be newer than the disk */
+				if (fs->csect[i] == sect) buf = fs->cbuf[i];
+			}
+#endif
+			if (sect == fs->winsect)		/* and the window newer than its cache slot */
+				buf = fs->win;
+			if (buf == fs->fm_buf && disk_read(fs->drv, buf, sect, 1) != RES_OK) {
+				res = FR_DISK_ERR;
+				break;
+			}
+			any = 0;
+			for (i = 0; i < cps && clst < fs->n_fatent; i++, clst++) {
+				if (clst >= 2 && (fs->fs_type == FS_FAT16 ?
+					LD_WORD(buf + i * 2) : LD_DWORD(buf + i * 4) & 0x0FFFFFFF) == 0) {
+					fs->fm_free++;
+					any = 1;
+				}
+			}
+			fs->fm_any |= any;
+			fs->fm_scan = clst;
+			if (clst % fs->fm_ucl == 0 || clst >= fs->n_fatent) {	/* End of a map range */
+				fm_mark(fs, clst - 1, fs->fm_any);
+				fs->fm_any = 0;
+			}
+		}
+		if (res == FR_OK && fs->fm_scan >= fs->n_fatent) {
+			if (fs->free_clust != fs->fm_free) {
+				fs->free_clust = fs->fm_free;
+				if (fs->fs_type == FS_FAT32) fs->fsi_flag = 1;
+			}
+			*nclst = fs->free_clust;
+		}
+	}
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -28,6 +28,20 @@ extern "C" {
 #error Wrong configuration file (ffconf.h).
 #endif
 
+#ifndef _FS_WINCACHE
+#define _FS_WINCACHE	0	/* Number of FAT/directory sectors cached behind win[] */
+#endif
+#if _FS_WINCACHE && _FS_TINY
+#error _FS_WINCACHE can not be used with _FS_TINY (file data goes through win[]).
+#endif
+#ifndef _FS_FREEMAP
+#define _FS_FREEMAP		0	/* Number of bits in the free cluster map */
+#endif
+#if _FS_FREEMAP && _FS_READONLY
+#undef _FS_FREEMAP
+#define _FS_FREEMAP		0
+#endif
+
 
 
 /* Definitions of volume management */
@@ -80,7 +94,7 @@ typedef struct {
 	BYTE	csize;			/* Sectors per cluster (1,2,4...128) */
 	BYTE	n_fats;			/* Number of FAT copies (1,2) */
 	BYTE	wflag;			/* win[] dirty flag (1:must be written back) */
-	BYTE	fsi_flag;		/* fsinfo dirty flag (1:must be written back) */
+	BYTE	fsi_flag;		/* fsinfo dirty flag (1:must be written back, 2:on close) */
 	WORD	id;				/* File system mount ID */
 	WORD	n_rootdir;		/* Number of root directory entries (FAT12/16) */
 #if _MAX_SS != 512
@@ -104,6 +118,23 @@ typedef struct {
 	DWORD	database;		/* Data start sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and Data on tiny cfg) */
+#if _FS_WINCACHE
+	DWORD	cnext;			/* Use stamp counter */
+	DWORD	csect[_FS_WINCACHE];	/* Sector in each cache slot (0:empty) */
+	DWORD	cstamp[_FS_WINCACHE];	/* Last use of each slot */
+	BYTE	cbuf[_FS_WINCACHE][_MAX_SS];	/* Cached sectors (word aligned for DMA, keep after the DWORDs) */
+#if !_FS_READONLY
+	BYTE	cflag[_FS_WINCACHE];	/* Slot dirty flags */
+#endif
+#endif
+#if _FS_FREEMAP
+	DWORD	fm_ucl;			/* Clusters per map bit (0:no map) */
+	DWORD	fm_scan;		/* Next cluster for f_scanfree (n_fatent:done) */
+	DWORD	fm_free;		/* Free clusters found by f_scanfree so far */
+	BYTE	fm_buf[_MAX_SS];	/* FAT sector being scanned (word aligned for DMA) */
+	BYTE	fm_any;			/* Free cluster in the map range being scanned */
+	BYTE	fm_map[(_FS_FREEMAP + 7) / 8];	/* Free cluster map */
+#endif
 } FATFS;
 
 
@@ -212,6 +243,7 @@ FRESULT f_readdir (DIR*, FILINFO*);					/* Read a directory item */
 FRESULT f_stat (const TCHAR*, FILINFO*);			/* Get file status */
 FRESULT f_write (FIL*, const void*, UINT, UINT*);	/* Write data to a file */
 FRESULT f_getfree (const TCHAR*, DWORD*, FATFS**);	/* Get number of free clusters on the drive */
+FRESULT f_scanfree (const TCHAR*, UINT, DWORD*);	/* Build the free cluster map a few sectors at a time */
 FRESULT f_truncate (FIL*);							/* Truncate file */
 FRESULT f_sync (FIL*);								/* Flush cached data of a writing file */
 FRESULT f_unlink (const TCHAR*);					/* Delete an existing file or directory */
@@ -251,6 +251,14 @@ static void uart_lld_serve_rx_end_irq(UARTDriver *uartp, uint32_t flags) {
   (void)flags;
 #endif
 
+  if (uartp->rxcircular) {
+    /* Circular receive, the buffer is half or completely filled and the
+       DMA goes on with the other half.*/
+    if (uartp->config->rxend_cb != NULL)
+      uartp->config->rxend_cb(uartp);
+    return;
+  }
+
   if (uartp->rxstate == UART_RX_IDLE) {
     /* Receiver in idle state, a callback is generated, if enabled, for each
        received character and then the driver stays in the same state.*/
@@ -321,6 +329,12 @@ static void serve_usart_irq(UARTDriver *uartp) {
     if (uartp->config->rxerr_cb != NULL)
       uartp->config->rxerr_cb(uartp, translate_errors(sr));
   }
+  if ((sr & USART_SR_IDLE) && uartp->rxcircular) {
+    /* Circular receive, a character time without data after the last
+       received one. The flag is cleared by the SR and DR reads above.*/
+    if (uartp->config->rxidle_cb != NULL)
+      uartp->config->rxidle_cb(uartp);
+  }
   if (sr & USART_SR_TC) {
     u->SR = ~USART_SR_TC;
 
@@ -670,6 +684,7 @@ void uart_lld_start(UARTDriver *uartp) {
 
   uartp->rxstate = UART_RX_IDLE;
   uartp->txstate = UART_TX_IDLE;
+  uartp->rxcircular = FALSE;
   usart_start(uartp);
 }
 
@@ -815,10 +830,61 @@ size_t uart_lld_stop_receive(UARTDriver *uartp) {
 
   dmaStreamDisable(uartp->dmarx);
   n = dmaStreamGetTransactionSize(uartp->dmarx);
+  if (uartp->rxcircular) {
+    uartp->usart->CR1 &= ~USART_CR1_IDLEIE;
+    uartp->rxcircular = FALSE;
+  }
   set_rx_idle_loop(uartp);
   return n;
 }
 
+/**
+ * @brief   Starts a circular receive operation on the UART peripheral.
+ * @details The DMA fills the buffer over and over, @p rxend_cb is called
+ *          when it is half and completely filled and @p rxidle_cb when the
+ *          line goes idle after a character; the write position is
+ *          @p n minus @p dmaStreamGetTransactionSize() of @p dmarx. The
+ *          receive runs until @p uartStopReceive().
+ * @note    No per character interrupt, the callbacks have to take the data
+ *          out before the DMA gets around the buffer.
+ *
+ * @param[in] uartp     pointer to the @p UARTDriver object
+ * @param[in] n         number of data frames in the buffer
+ * @param[out] rxbuf    the receive buffer
+ *
+ * @api
+ */
+void uartSTM32StartReceiveCircular(UARTDriver *uartp, size_t n,
+                                   void *rxbuf) {
+
+  chDbgCheck((uartp != NULL) && (n > 0) && (rxbuf != NULL),
+             "uartSTM32StartReceiveCircular");
+
+  chSysLock();
+  chDbgAssert((uartp->state == UART_READY) &&
+              (uartp->rxstate == UART_RX_IDLE),
+              "uartSTM32StartReceiveCircular(), #1", "not active");
+
+  /* Stopping previous activity (idle state).*/
+  dmaStreamDisable(uartp->dmarx);
+
+  /* RX DMA channel preparation and start.*/
+  dmaStreamSetMemory0(uartp->dmarx, rxbuf);
+  dmaStreamSetTransactionSize(uartp->dmarx, n);
+  dmaStreamSetMode(uartp->dmarx, uartp->dmamode    | STM32_DMA_CR_DIR_P2M |
+                                 STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC    |
+                                 STM32_DMA_CR_HTIE | STM32_DMA_CR_TCIE);
+  uartp->rxcircular = TRUE;
+  uartp->rxstate = UART_RX_ACTIVE;
+
+  /* A stale idle flag is cleared before its interrupt is enabled.*/
+  (void)uartp->usart->SR;
+  (void)uartp->usart->DR;
+  uartp->usart->CR1 |= USART_CR1_IDLEIE;
+  dmaStreamEnable(uartp->dmarx);
+  chSysUnlock();
+}
+
 #endif /* HAL_USE_UART */
 
 /** @} */
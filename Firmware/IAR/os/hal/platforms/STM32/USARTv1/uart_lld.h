@@ -579,6 +579,12 @@ typedef struct {
    * @brief Initialization value for the CR3 register.
    */
   uint16_t                  cr3;
+  /**
+   * @brief Receive line idle callback.
+   * @note  Only used by a circular receive, see
+   *        @p uartSTM32StartReceiveCircular().
+   */
+  uartcb_t                  rxidle_cb;
 } UARTConfig;
 
 /**
@@ -625,6 +631,10 @@ struct UARTDriver {
    * @brief Default receive buffer while into @p UART_RX_IDLE state.
    */
   volatile uint16_t         rxbuf;
+  /**
+   * @brief The receive in progress is a circular one.
+   */
+  bool_t                    rxcircular;
 };
 
 /*===========================================================================*/
@@ -669,6 +679,8 @@ extern "C" {
   size_t uart_lld_stop_send(UARTDriver *uartp);
   void uart_lld_start_receive(UARTDriver *uartp, size_t n, void *rxbuf);
   size_t uart_lld_stop_receive(UARTDriver *uartp);
+  void uartSTM32StartReceiveCircular(UARTDriver *uartp, size_t n,
+                                     void *rxbuf);
 #ifdef __cplusplus
 }
 #endif
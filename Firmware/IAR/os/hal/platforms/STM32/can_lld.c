@@ -155,7 +155,17 @@ static void can_lld_rx0_handler(CANDriver *canp) {
   uint32_t rf0r;
 
   rf0r = canp->can->RF0R;
-  if ((rf0r & CAN_RF0R_FMP0) > 0) {
+  if (((rf0r & CAN_RF0R_FMP0) > 0) && (canp->config->rx_cb != NULL)) {
+    /* Frames are handed to the callback as they arrive, the queue is
+       emptied here and its interrupt stays enabled.*/
+    CANRxFrame crf;
+
+    do {
+      can_lld_receive(canp, 1, &crf);
+      canp->config->rx_cb(1, &crf);
+    } while ((canp->can->RF0R & CAN_RF0R_FMP0) > 0);
+  }
+  else if ((rf0r & CAN_RF0R_FMP0) > 0) {
     /* No more receive events until the queue 0 has been emptied.*/
     canp->can->IER &= ~CAN_IER_FMPIE0;
     chSysLockFromIsr();
@@ -184,7 +194,17 @@ static void can_lld_rx1_handler(CANDriver *canp) {
   uint32_t rf1r;
 
   rf1r = canp->can->RF1R;
-  if ((rf1r & CAN_RF1R_FMP1) > 0) {
+  if (((rf1r & CAN_RF1R_FMP1) > 0) && (canp->config->rx_cb != NULL)) {
+    /* Frames are handed to the callback as they arrive, the queue is
+       emptied here and its interrupt stays enabled.*/
+    CANRxFrame crf;
+
+    do {
+      can_lld_receive(canp, 2, &crf);
+      canp->config->rx_cb(2, &crf);
+    } while ((canp->can->RF1R & CAN_RF1R_FMP1) > 0);
+  }
+  else if ((rf1r & CAN_RF1R_FMP1) > 0) {
     /* No more receive events until the queue 0 has been emptied.*/
     canp->can->IER &= ~CAN_IER_FMPIE1;
     chSysLockFromIsr();
@@ -238,6 +238,16 @@ typedef struct {
   uint32_t                  register2;
 } CANFilter;
 
+/**
+ * @brief   Receive callback type.
+ * @note    Called from the ISR for every received frame, outside the kernel
+ *          lock.
+ *
+ * @param[in] mailbox   receive FIFO the frame came from (1 or 2)
+ * @param[in] crfp      pointer to the received frame
+ */
+typedef void (*canrxcallback_t)(canmbx_t mailbox, const CANRxFrame *crfp);
+
 /**
  * @brief   Driver configuration structure.
  */
@@ -254,6 +264,13 @@ typedef struct {
    *          their status in this field.
    */
   uint32_t                  btr;
+  /**
+   * @brief   Receive callback or @p NULL.
+   * @note    When set, the ISR empties the receive FIFOs into the callback
+   *          and keeps their interrupts enabled, @p canReceive() and the
+   *          @p rxfull_event are not used then.
+   */
+  canrxcallback_t           rx_cb;
 } CANConfig;
 
 /**
@@ -124,7 +124,11 @@ CH_IRQ_HANDLER(ADC1_2_3_IRQHandler) {
     if (ADCD1.grpp != NULL)
       _adc_isr_error_code(&ADCD1, ADC_ERR_OVERFLOW);
   }
-  /* TODO: Add here analog watchdog handling.*/
+  /* Analog watchdog, only enabled by adcSTM32StartWatchdog().*/
+  if ((sr & ADC_SR_AWD) && (ADC1->CR1 & ADC_CR1_AWDIE)) {
+    if (ADCD1.grpp != NULL)
+      _adc_isr_error_code(&ADCD1, ADC_ERR_AWD);
+  }
 #endif /* STM32_ADC_USE_ADC1 */
 
 #if STM32_ADC_USE_ADC2
@@ -138,7 +142,11 @@ CH_IRQ_HANDLER(ADC1_2_3_IRQHandler) {
     if (ADCD2.grpp != NULL)
       _adc_isr_error_code(&ADCD2, ADC_ERR_OVERFLOW);
   }
-  /* TODO: Add here analog watchdog handling.*/
+  /* Analog watchdog, only enabled by adcSTM32StartWatchdog().*/
+  if ((sr & ADC_SR_AWD) && (ADC2->CR1 & ADC_CR1_AWDIE)) {
+    if (ADCD2.grpp != NULL)
+      _adc_isr_error_code(&ADCD2, ADC_ERR_AWD);
+  }
 #endif /* STM32_ADC_USE_ADC2 */
 
 #if STM32_ADC_USE_ADC3
@@ -152,7 +160,11 @@ CH_IRQ_HANDLER(ADC1_2_3_IRQHandler) {
     if (ADCD3.grpp != NULL)
       _adc_isr_error_code(&ADCD3, ADC_ERR_OVERFLOW);
   }
-  /* TODO: Add here analog watchdog handling.*/
+  /* Analog watchdog, only enabled by adcSTM32StartWatchdog().*/
+  if ((sr & ADC_SR_AWD) && (ADC3->CR1 & ADC_CR1_AWDIE)) {
+    if (ADCD3.grpp != NULL)
+      _adc_isr_error_code(&ADCD3, ADC_ERR_AWD);
+  }
 #endif /* STM32_ADC_USE_ADC3 */
 
   CH_IRQ_EPILOGUE();
@@ -423,6 +435,59 @@ void adcSTM32DisableVBATE(void) {
   ADC->CCR &= ~ADC_CCR_VBATE;
 }
 
+/**
+ * @brief   Starts a watchdog-only conversion.
+ * @details The group is converted continuously without DMA, the results are
+ *          not read and no interrupt is generated until the analog watchdog
+ *          detects a value outside [@p low, @p high]. Then the conversion is
+ *          stopped and the group error callback is invoked with
+ *          @p ADC_ERR_AWD.
+ * @note    The watched channels are selected by the @p ADC_CR1_AWDEN,
+ *          @p ADC_CR1_AWDSGL and @p ADC_CR1_AWDCH bits of the group CR1,
+ *          the group buffer depth and end callback are not used.
+ * @note    This is an STM32-only functionality.
+ *
+ * @param[in] adcp      pointer to the @p ADCDriver object
+ * @param[in] grpp      pointer to a @p ADCConversionGroup object
+ * @param[in] low       low threshold, 12 bits
+ * @param[in] high      high threshold, 12 bits
+ *
+ * @api
+ */
+void adcSTM32StartWatchdog(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                           uint16_t low, uint16_t high) {
+  uint32_t cr2;
+
+  chDbgCheck((adcp != NULL) && (grpp != NULL) && (grpp->error_cb != NULL),
+             "adcSTM32StartWatchdog");
+
+  chSysLock();
+  chDbgAssert(adcp->state == ADC_READY,
+              "adcSTM32StartWatchdog(), #1", "not ready");
+  adcp->samples = NULL;
+  adcp->depth   = 0;
+  adcp->grpp    = grpp;
+  adcp->state   = ADC_ACTIVE;
+
+  adcp->adc->SR    = 0;
+  adcp->adc->SMPR1 = grpp->smpr1;
+  adcp->adc->SMPR2 = grpp->smpr2;
+  adcp->adc->SQR1  = grpp->sqr1;
+  adcp->adc->SQR2  = grpp->sqr2;
+  adcp->adc->SQR3  = grpp->sqr3;
+  adcp->adc->LTR   = low;
+  adcp->adc->HTR   = high;
+  adcp->adc->CR1   = grpp->cr1 | ADC_CR1_AWDIE | ADC_CR1_SCAN;
+
+  /* No DMA and EOC at the end of the sequence only, so there is no overrun
+     detection either.*/
+  cr2 = (grpp->cr2 | ADC_CR2_ADON | ADC_CR2_CONT) &
+        ~(ADC_CR2_DMA | ADC_CR2_DDS | ADC_CR2_EOCS | ADC_CR2_SWSTART);
+  adcp->adc->CR2 = cr2;
+  adcp->adc->CR2 = cr2 | ADC_CR2_SWSTART;
+  chSysUnlock();
+}
+
 #endif /* HAL_USE_ADC */
 
 /** @} */
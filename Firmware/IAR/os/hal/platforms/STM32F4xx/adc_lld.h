@@ -306,7 +306,8 @@ typedef uint16_t adc_channels_num_t;
  */
 typedef enum {
   ADC_ERR_DMAFAILURE = 0,                   /**< DMA operations failure.    */
-  ADC_ERR_OVERFLOW = 1                      /**< ADC overflow condition.    */
+  ADC_ERR_OVERFLOW = 1,                     /**< ADC overflow condition.    */
+  ADC_ERR_AWD = 2                           /**< Analog watchdog triggered. */
 } adcerror_t;
 
 /**
@@ -556,6 +557,8 @@ extern "C" {
   void adcSTM32DisableTSVREFE(void);
   void adcSTM32EnableVBATE(void);
   void adcSTM32DisableVBATE(void);
+  void adcSTM32StartWatchdog(ADCDriver *adcp, const ADCConversionGroup *grpp,
+                             uint16_t low, uint16_t high);
 #ifdef __cplusplus
 }
 #endif
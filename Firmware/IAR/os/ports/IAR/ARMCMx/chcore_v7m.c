@@ -195,4 +195,104 @@ void _port_irq_epilogue(void) {
   port_unlock_from_isr();
 }
 
+#if CORTEX_TICKLESS_IDLE || defined(__DOXYGEN__)
+/**
+ * @brief   Counts left in a period that ends too close to be reprogrammed.
+ */
+#define ST_MIN_COUNTS   256
+
+/**
+ * @brief   Restarts the running SYSTICK counter.
+ * @details The counter reaches zero @p counts after it showed @p now. It
+ *          is never stopped, the counts that went by since @p now are read
+ *          back from it and only the few of the write sequence itself are
+ *          an estimate, @p CORTEX_TICKLESS_SKEW.
+ * @note    The new period is loaded one count after the write, @p ST_RVR
+ *          may be changed again after that without affecting it.
+ */
+static void st_restart(uint32_t now, uint32_t counts) {
+
+  ST_RVR = counts - 1 - CORTEX_TICKLESS_SKEW - (now - ST_CVR);
+  ST_CVR = 0;
+}
+
+/**
+ * @brief   Idle sleep with the system tick suppressed.
+ * @details Invoked by the idle thread instead of a plain @p WFI. If no
+ *          virtual timer expires within the next tick the SYSTICK period is
+ *          stretched up to the first deadline and the core sleeps; after
+ *          the wake-up the elapsed ticks are fed to the virtual timers and
+ *          the SYSTICK continues in phase with the original tick.
+ * @note    Interrupts are masked through PRIMASK across the sleep, a pending
+ *          interrupt still ends the @p WFI but it is served only after the
+ *          system time has been brought up to date.
+ */
+void _port_tickless_idle(void) {
+  uint32_t reload, ticks, now, wrapped, period, future, next, elapsed;
+
+  chSysLock();
+  reload = (ST_RVR & RVR_RELOAD_MASK) + 1;
+  ticks = RVR_RELOAD_MASK / reload;
+  if (((VTList *)vtlist.vt_next != &vtlist) && (vtlist.vt_next->vt_time < ticks))
+    ticks = vtlist.vt_next->vt_time;
+  __disable_interrupt();
+  now = ST_CVR;
+  if ((ticks < 2) || (now < ST_MIN_COUNTS) || (SCB_ICSR & ICSR_PENDSTSET)) {
+    /* Next tick is due anyway.*/
+    chSysUnlock();
+    __enable_interrupt();
+    asm ("wfi");
+    return;
+  }
+
+  /* The stretched period ends exactly on the tick that expires the first
+     timer. BASEPRI is released so that any interrupt can wake the core.*/
+  chSysUnlock();
+  st_restart(now, now + (ticks - 1) * reload);
+
+  asm ("wfi");
+
+  /* The counter first, then the flag, a wrap in between shows in the
+     flag. A period about to end is let end.*/
+  now = ST_CVR;
+  wrapped = ST_CSR & CSR_COUNTFLAG_MASK;
+  if (!wrapped && (now < ST_MIN_COUNTS)) {
+    while (!(ST_CSR & CSR_COUNTFLAG_MASK))
+      ;
+    wrapped = 1;
+  }
+
+  if (wrapped) {
+    /* Woken by the stretched tick, its interrupt is pending and accounts
+       for the last tick. The counter already runs the stretched period
+       again, the next tick is one reload after the wrap.*/
+    period = (ST_RVR & RVR_RELOAD_MASK) + 1;
+    now = ST_CVR;
+    elapsed = ticks - 1;
+    next = reload - (period - now);
+  }
+  else {
+    /* Woken by another source, ticks still in the future and the counts
+       to the next tick boundary.*/
+    future = (now - 1) / reload + 1;
+    elapsed = ticks - future;
+    next = now - (future - 1) * reload;
+  }
+  if (next < ST_MIN_COUNTS) {
+    /* Too close to reprogram, accounted here.*/
+    elapsed++;
+    next += reload;
+  }
+  st_restart(now, next);
+
+  chSysLock();
+  while (elapsed--)
+    chVTDoTickI();
+  ST_RVR = reload - 1;
+  __enable_interrupt();
+  chSchRescheduleS();
+  chSysUnlock();
+}
+#endif /* CORTEX_TICKLESS_IDLE */
+
 /** @} */
@@ -86,6 +86,34 @@
 #define CORTEX_ENABLE_WFI_IDLE          FALSE
 #endif
 
+/**
+ * @brief   Suppresses the system tick while the idle thread sleeps.
+ * @details The SYSTICK is reprogrammed to expire at the first virtual timer
+ *          deadline, at most the 24 bits counter range, the ticks that
+ *          elapsed are accounted when an interrupt wakes the core.
+ * @note    Requires @p CORTEX_ENABLE_WFI_IDLE and the SYSTICK clocked from
+ *          the core clock with a 1 tick reload value, as the HAL sets it.
+ * @note    Not compatible with @p CH_DBG_SYSTEM_STATE_CHECK, the ticks are
+ *          accounted from the idle thread.
+ */
+#if !defined(CORTEX_TICKLESS_IDLE)
+#define CORTEX_TICKLESS_IDLE            FALSE
+#endif
+
+/**
+ * @brief   SYSTICK counts the tickless restart loses to its own code.
+ * @details Counts from the read of the running counter to the write that
+ *          restarts it, see @p st_restart(). The time between the wake-up
+ *          and the restart is read back from the counter, this is the rest.
+ */
+#if !defined(CORTEX_TICKLESS_SKEW)
+#define CORTEX_TICKLESS_SKEW            4
+#endif
+
+#if CORTEX_TICKLESS_IDLE && !CORTEX_ENABLE_WFI_IDLE
+#error "CORTEX_TICKLESS_IDLE requires CORTEX_ENABLE_WFI_IDLE"
+#endif
+
 /**
  * @brief   SYSTICK handler priority.
  * @note    The default SYSTICK handler priority is calculated as the priority
@@ -462,9 +490,12 @@ struct context {
  *          The simplest implementation is an empty function or macro but this
  *          would not take advantage of architecture-specific power saving
  *          modes.
- * @note    Implemented as an inlined @p WFI instruction.
+ * @note    Implemented as an inlined @p WFI instruction, or as a WFI with the
+ *          system tick suppressed if @p CORTEX_TICKLESS_IDLE is enabled.
  */
-#if CORTEX_ENABLE_WFI_IDLE || defined(__DOXYGEN__)
+#if CORTEX_TICKLESS_IDLE
+#define port_wait_for_interrupt() _port_tickless_idle()
+#elif CORTEX_ENABLE_WFI_IDLE || defined(__DOXYGEN__)
 #define port_wait_for_interrupt() asm ("wfi")
 #else
 #define port_wait_for_interrupt()
@@ -499,6 +530,9 @@ extern "C" {
   void _port_switch_from_isr(void);
   void _port_exit_from_isr(void);
   void _port_switch(Thread *ntp, Thread *otp);
+#if CORTEX_TICKLESS_IDLE
+  void _port_tickless_idle(void);
+#endif
   void _port_thread_start(void);
 #ifdef __cplusplus
 }
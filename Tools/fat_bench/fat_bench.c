@@ -0,0 +1,189 @@
+/*
+ * Time to the first cluster allocation on a nearly full FAT32 card, with
+ * the logger's FatFs build (free cluster map, FSInfo hint), on a sparse
+ * image file. Build from this directory:
+ *
+ *   cc -O2 -I. -I../../Firmware/IAR/ext/fatfs/src -o fat_bench fat_bench.c \
+ *      ../../Firmware/IAR/ext/fatfs/src/ff.c
+ *
+ *   ./fat_bench [image] [size GB] [free %] [us per sector read]
+ *
+ * The image is created (sparse) and formatted if it does not exist. All
+ * clusters but the given share at the end of the volume are then marked
+ * in use, which is where a long running logger leaves a card. Sector
+ * reads are the cost that matters on the card, the time column uses the
+ * given latency per read (single block reads of an SD card in SDIO mode
+ * take a few hundred us).
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ff.h"
+#include "diskio.h"
+
+static int img;
+static DWORD img_sectors;
+static unsigned long sect_reads, sect_writes;
+
+DSTATUS disk_initialize(BYTE drv) { (void)drv; return 0; }
+DSTATUS disk_status(BYTE drv) { (void)drv; return 0; }
+
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, UINT count)
+{
+  (void)drv;
+  if (pread(img, buff, (size_t)count * 512, (off_t)sector * 512) != (ssize_t)count * 512)
+    return RES_ERROR;
+  sect_reads += count;
+  return RES_OK;
+}
+
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, UINT count)
+{
+  (void)drv;
+  if (pwrite(img, buff, (size_t)count * 512, (off_t)sector * 512) != (ssize_t)count * 512)
+    return RES_ERROR;
+  sect_writes += count;
+  return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+  (void)drv;
+  switch (ctrl) {
+  case CTRL_SYNC: return RES_OK;
+  case GET_SECTOR_COUNT: *(DWORD *)buff = img_sectors; return RES_OK;
+  case GET_SECTOR_SIZE: *(WORD *)buff = 512; return RES_OK;
+  case GET_BLOCK_SIZE: *(DWORD *)buff = 1; return RES_OK;
+  }
+  return RES_PARERR;
+}
+
+DWORD get_fattime(void) { return 0; }
+
+static FATFS fs;
+static FIL fil;
+static BYTE cluster_buf[64 * 1024];
+
+static void remount(void)
+{
+  f_mount(0, NULL);
+  memset(&fs, 0, sizeof fs);
+  f_mount(0, &fs);
+}
+
+/* marks [2, first_free) in use in both FATs, the rest free, and writes
+   FSInfo with the given next free hint (0xFFFFFFFF: none) */
+static void prepare(DWORD first_free, DWORD hint)
+{
+  static BYTE sec[512];
+  DWORD s, c, e, nf, fsi;
+
+  for (s = 0; s < fs.fsize; s++) {
+    for (e = 0; e < 128; e++) {
+      c = s * 128 + e;
+      if (c < 2)
+        e == 0 ? (sec[0] = 0xF8, sec[1] = sec[2] = 0xFF, sec[3] = 0x0F) : (sec[4] = sec[5] = sec[6] = 0xFF, sec[7] = 0x0F);
+      else {
+        DWORD v = (c < first_free && c < fs.n_fatent) ? 0x0FFFFFFF : 0;
+        sec[e * 4] = (BYTE)v; sec[e * 4 + 1] = (BYTE)(v >> 8);
+        sec[e * 4 + 2] = (BYTE)(v >> 16); sec[e * 4 + 3] = (BYTE)(v >> 24);
+      }
+    }
+    if (s == 0) {
+      /* the root directory cluster stays in use */
+      DWORD rc = fs.dirbase;
+      if (rc / 128 == 0) { sec[rc * 4] = sec[rc * 4 + 1] = sec[rc * 4 + 2] = 0xFF; sec[rc * 4 + 3] = 0x0F; }
+    }
+    for (nf = 0; nf < fs.n_fats; nf++)
+      pwrite(img, sec, 512, (off_t)(fs.fatbase + nf * fs.fsize + s) * 512);
+  }
+
+  fsi = fs.fsi_sector;
+  pread(img, sec, 512, (off_t)fsi * 512);
+  memset(sec + 488, 0xFF, 4); /* free count not known */
+  sec[492] = (BYTE)hint; sec[493] = (BYTE)(hint >> 8); sec[494] = (BYTE)(hint >> 16); sec[495] = (BYTE)(hint >> 24);
+  pwrite(img, sec, 512, (off_t)fsi * 512);
+}
+
+/* creates a file and writes one cluster to it, returns sector reads */
+static unsigned long first_alloc(const char *name)
+{
+  UINT bw;
+  unsigned long r0 = sect_reads;
+
+  if (f_open(&fil, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) { printf("open failed\n"); exit(1); }
+  f_write(&fil, cluster_buf, fs.csize * 512, &bw);
+  f_close(&fil);
+  if (bw != fs.csize * 512u) { printf("write failed\n"); exit(1); }
+
+  return sect_reads - r0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = argc > 1 ? argv[1] : "fat_bench.img";
+  double gb = argc > 2 ? atof(argv[2]) : 32;
+  double free_pct = argc > 3 ? atof(argv[3]) : 1;
+  double us_per_read = argc > 4 ? atof(argv[4]) : 300;
+  DWORD first_free, nclst;
+  unsigned long n, steps;
+
+  img = open(path, O_RDWR | O_CREAT, 0644);
+  if (img < 0) { perror(path); return 1; }
+  img_sectors = (DWORD)(gb * 1024 * 1024 * 2);
+  if (ftruncate(img, (off_t)img_sectors * 512) != 0) { perror("ftruncate"); return 1; }
+
+  f_mount(0, &fs);
+  if (f_opendir(&(DIR){0}, "") != FR_OK) {
+    printf("formatting %.0f GB ...\n", gb);
+    if (f_mkfs(0, 0, 32768) != FR_OK) { printf("f_mkfs failed\n"); return 1; }
+    remount();
+  }
+  f_opendir(&(DIR){0}, "");
+  if (fs.fs_type != FS_FAT32) { printf("not FAT32\n"); return 1; }
+
+  first_free = fs.n_fatent - (DWORD)((fs.n_fatent - 2) * free_pct / 100);
+  printf("%lu clusters of %u KB, FAT %lu sectors, free from cluster %lu\n\n",
+         (unsigned long)(fs.n_fatent - 2), fs.csize / 2, (unsigned long)fs.fsize, (unsigned long)first_free);
+  printf("%-44s %10s %10s\n", "", "reads", "ms");
+
+  /* 1. no FSInfo hint: create_chain scans from the start of the FAT */
+  prepare(first_free, 0xFFFFFFFF);
+  remount();
+  n = first_alloc("A.BIN");
+  printf("%-44s %10lu %10.1f\n", "first allocation, no FSInfo hint", n, n * us_per_read / 1000);
+
+  /* 2. FSInfo hint right before the free space */
+  prepare(first_free, first_free - 1);
+  remount();
+  n = first_alloc("B.BIN");
+  printf("%-44s %10lu %10.1f\n", "first allocation, FSInfo hint", n, n * us_per_read / 1000);
+
+  /* 3. no hint, the map built in the background first (16 sectors a step) */
+  prepare(first_free, 0xFFFFFFFF);
+  remount();
+  n = sect_reads;
+  steps = 0;
+  do {
+    f_scanfree("", 16, &nclst);
+    steps++;
+  } while (nclst == 0xFFFFFFFF);
+  n = sect_reads - n;
+  printf("%-44s %10lu %10.1f  (%lu steps, %lu free)\n", "background scan", n, n * us_per_read / 1000,
+         steps, (unsigned long)nclst);
+  n = first_alloc("C.BIN");
+  printf("%-44s %10lu %10.1f\n", "first allocation after the scan, no hint", n, n * us_per_read / 1000);
+
+  /* 4. the map also remembers full ranges found by an allocation */
+  fs.last_clust = 0;
+  n = first_alloc("D.BIN");
+  printf("%-44s %10lu %10.1f\n", "next allocation from the start, map only", n, n * us_per_read / 1000);
+
+  f_mount(0, NULL);
+  close(img);
+  return 0;
+}
@@ -0,0 +1,31 @@
+/* FatFs configuration for the host build of fat_bench, same options as the
+   logger (demos/ARMCM4-STM32F407-DISCOVERY/ffconf.h) except the ones that
+   need ChibiOS (reentrancy) or are not needed here (LFN) */
+#ifndef _FFCONF
+#define _FFCONF 6502	/* Revision ID */
+
+#define	_FS_TINY		0
+#define _FS_WINCACHE	4
+#define _FS_FREEMAP		4096
+#define _FS_READONLY	0
+#define _FS_MINIMIZE	0
+#define	_USE_STRFUNC	0
+#define	_USE_MKFS		1
+#define	_USE_FORWARD	0
+#define	_USE_FASTSEEK	1
+#define _CODE_PAGE		1252
+#define	_USE_LFN		0
+#define	_MAX_LFN		255
+#define	_LFN_UNICODE	0
+#define _FS_RPATH		0
+#define _VOLUMES		1
+#define	_MAX_SS			512
+#define	_MULTI_PARTITION	0
+#define	_USE_ERASE		0
+#define _WORD_ACCESS	0
+#define _FS_REENTRANT	0
+#define _FS_TIMEOUT		1000
+#define	_SYNC_t			int
+#define	_FS_SHARE		0
+
+#endif /* _FFCONF */
@@ -0,0 +1,45 @@
+/* ChibiOS stand-ins for the host build of the firmware's file_utils.c: the
+   memory pool calls it makes, single threaded */
+#ifndef _CH_H_
+#define _CH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int bool_t;
+#define TRUE  1
+#define FALSE 0
+
+typedef struct
+{
+  void *next;
+  size_t size;
+} MemoryPool;
+
+#define MEMORYPOOL_DECL(name, size, provider) MemoryPool name = { NULL, size }
+
+static inline void chPoolFree(MemoryPool *mp, void *p)
+{
+  *(void **)p = mp->next;
+  mp->next = p;
+}
+
+static inline void *chPoolAlloc(MemoryPool *mp)
+{
+  void *p = mp->next;
+
+  if (p != NULL)
+    mp->next = *(void **)p;
+  return p;
+}
+
+static inline void chPoolLoadArray(MemoryPool *mp, void *p, size_t n)
+{
+  while (n--)
+  {
+    chPoolFree(mp, p);
+    p = (char *)p + mp->size;
+  }
+}
+
+#endif /* _CH_H_ */
@@ -0,0 +1,376 @@
+/*
+ * fseek_test - seek by time through the sidecar index (.idx) with the
+ * firmware's fseek_time_ (file_utils.c, built here as it is), on the
+ * logger's FatFs build and a sparse image file.
+ *
+ * A binary log and its index are written through the file_utils handles the
+ * way the logger writes them, with a filler file growing in between so both
+ * are fragmented and the index probes go through a link map. Then:
+ *
+ *  - fseek_time_ puts the log on the frame of the last entry at or before
+ *    the time, for times before, on, between and after the entries;
+ *  - no link map is left on the handles: the log, open for append during
+ *    the seeks, takes the rest of the frames afterwards (writes past a map
+ *    fail), a map the caller made is kept;
+ *  - the record at the seek position is the frame of the sample found;
+ *  - with the .vlb and .idx copied out of the image, vlog_window finds the
+ *    same samples and vlog_decode -s decodes them as they were written.
+ *
+ * Build from this directory, with vlog_decode and vlog_window built in ../:
+ *
+ *   cc -O2 -I. -I../../Firmware/IAR/ext/fatfs/src -I../../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY \
+ *      -o fseek_test fseek_test.c ../../Firmware/IAR/ext/fatfs/src/ff.c \
+ *      ../../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY/vlog_bin.c
+ *
+ *   ./fseek_test [path of vlog_decode] [path of vlog_window]   (../vlog_decode, ../vlog_window)
+ *   exit code 0 when every check passes
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "file_utils.c" // the handles are opaque outside of it
+#include "diskio.h"
+#include "vlog_bin.h"
+
+#define TEST_IMAGE   "fseek_test.img"
+#define TEST_VLB     "fseek_test.vlb"
+#define TEST_IDX     "fseek_test.idx"
+#define TEST_OUT     "fseek_test.csv"
+#define IMAGE_MB     128
+#define CLUSTER      1024  // small clusters, many of them per file
+#define CHANNELS     2
+#define CH_MASK      0x03
+#define PERIOD_US    1000
+#define HEAD_FRAMES  160   // written before the seeks
+#define TAIL_FRAMES  40    // written after them, through the same handle
+#define FILL_EVERY   16    // frames between filler writes
+#define SAMPLES      ((HEAD_FRAMES + TAIL_FRAMES) * VLOG_FRAME_SAMPLES)
+
+FATFS SDC_FS;
+bool_t fs_ready;
+
+static int img;
+static DWORD img_sectors;
+
+typedef struct
+{
+  uint32_t sample;
+  uint32_t offset;
+  uint64_t time_us;
+} entry_t;
+
+static uint64_t sample_time[SAMPLES];
+static uint16_t sample_value[SAMPLES][CHANNELS];
+static uint32_t sample_no = 0;
+static entry_t entries[HEAD_FRAMES + TAIL_FRAMES];
+static int entry_count = 0;
+
+static vlog_frame_t frame;
+static vlog_index_t index_;
+static uint8_t rec[65536];
+static uint8_t fill_buf[3 * CLUSTER];
+static float zero[VLOG_MAX_CHANNELS] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+static float gain[VLOG_MAX_CHANNELS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+static float filt[VLOG_MAX_CHANNELS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+
+static int failures = 0;
+
+DSTATUS disk_initialize(BYTE drv) { (void)drv; return 0; }
+DSTATUS disk_status(BYTE drv) { (void)drv; return 0; }
+
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, UINT count)
+{
+  (void)drv;
+  if (pread(img, buff, (size_t)count * 512, (off_t)sector * 512) != (ssize_t)count * 512)
+    return RES_ERROR;
+  return RES_OK;
+}
+
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, UINT count)
+{
+  (void)drv;
+  if (pwrite(img, buff, (size_t)count * 512, (off_t)sector * 512) != (ssize_t)count * 512)
+    return RES_ERROR;
+  return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+  (void)drv;
+  switch (ctrl) {
+  case CTRL_SYNC: return RES_OK;
+  case GET_SECTOR_COUNT: *(DWORD *)buff = img_sectors; return RES_OK;
+  case GET_SECTOR_SIZE: *(WORD *)buff = 512; return RES_OK;
+  case GET_BLOCK_SIZE: *(DWORD *)buff = 1; return RES_OK;
+  }
+  return RES_PARERR;
+}
+
+DWORD get_fattime(void) { return 0; }
+
+static uint32_t rnd(void)
+{
+  static uint32_t state = 4711;
+
+  state = state * 1103515245UL + 12345;
+  return state >> 8;
+}
+
+static void check(const char *name, int bad)
+{
+  printf("%s %s\n", bad ? "FAIL" : "ok  ", name);
+  if (bad) failures++;
+}
+
+static int put(file_t *f, uint16_t length)
+{
+  return fwrite_(rec, 1, length, f) == length;
+}
+
+// frames of random samples with pauses, an index entry per frame, the
+// filler grows every FILL_EVERY frames; returns 0 if a write failed
+static int write_frames(file_t *log, file_t *idx, file_t *fill, int frames)
+{
+  static uint64_t t = 0;
+  static uint16_t v[CHANNELS];
+  uint32_t offset;
+  uint16_t length;
+  int i, k;
+
+  while (frames-- > 0)
+  {
+    for (i = 0; i < VLOG_FRAME_SAMPLES; i++)
+    {
+      t += PERIOD_US + (rnd() % 41) - 20;
+      if (rnd() % 300 == 0)
+        t += rnd() % 2000000; // a pause, times are not linear in samples
+      for (k = 0; k < CHANNELS; k++)
+        v[k] = (uint16_t)(v[k] + (rnd() % 601) - 300);
+      sample_time[sample_no] = t;
+      memcpy(sample_value[sample_no], v, sizeof(v));
+      vlog_frame_add(&frame, sample_no++, t, v);
+    }
+
+    offset = ftell_(log);
+    length = vlog_frame_close(&frame);
+    if (fwrite_(frame.buf, 1, length, log) != length)
+      return 0;
+    vlog_index_add(&index_, sample_no - VLOG_FRAME_SAMPLES, offset);
+
+    entries[entry_count].sample = sample_no - VLOG_FRAME_SAMPLES;
+    entries[entry_count].offset = offset;
+    entries[entry_count].time_us = sample_time[sample_no - VLOG_FRAME_SAMPLES];
+    if (!put(idx, vlog_put_idx_entry(rec, entries[entry_count].sample, offset, entries[entry_count].time_us)))
+      return 0;
+    entry_count++;
+
+    if (entry_count % FILL_EVERY == 0 &&
+        fwrite_(fill_buf, 1, (1 + rnd() % 3) * CLUSTER, fill) == 0)
+      return 0;
+  }
+  return 1;
+}
+
+// the entry fseek_time_ should find for t_us
+static const entry_t *expected_entry(uint64_t t_us)
+{
+  int i = 0;
+
+  while (i + 1 < entry_count && entries[i + 1].time_us <= t_us)
+    i++;
+  return &entries[i];
+}
+
+// times around every entry, in pauses, before and after all of them
+static int seek_targets(uint64_t *t)
+{
+  int n = 0, i;
+
+  t[n++] = 0;
+  t[n++] = entries[entry_count - 1].time_us + 100000000ULL;
+  for (i = 0; i < entry_count; i += 7)
+  {
+    t[n++] = entries[i].time_us;
+    t[n++] = entries[i].time_us - 1;
+    t[n++] = entries[i].time_us + 1;
+  }
+  for (i = 0; i < 200; i++)
+    t[n++] = sample_time[rnd() % sample_no] + rnd() % 3000;
+  return n;
+}
+
+// copies a file out of the image
+static int extract(const char *name, const char *host_name)
+{
+  static uint8_t buf[4096];
+  file_t *src = fopen_(name, "r");
+  FILE *dst = fopen(host_name, "wb");
+  size_t n;
+  int ok = src != 0 && dst != NULL;
+
+  while (ok && (n = fread_(buf, 1, sizeof(buf), src)) > 0)
+    ok = fwrite(buf, 1, n, dst) == n;
+  if (src) fclose_(src);
+  if (dst) fclose(dst);
+  return ok;
+}
+
+// the sample line vlog_decode writes (default "%f" format, zero 0, gain 1)
+static void sample_line(char *s, uint32_t n)
+{
+  int k;
+
+  s += sprintf(s, "%llu", (unsigned long long)sample_time[n]);
+  for (k = 0; k < CHANNELS; k++)
+    s += sprintf(s, ",%f", (double)sample_value[n][k] / (1 << VLOG_VALUE_FRAC_BITS));
+  strcpy(s, "\r\n");
+}
+
+// runs vlog_window and vlog_decode for t_us, 0 if they do not agree with sample
+static int tools_agree(const char *decoder, const char *window, uint64_t t_us, uint32_t sample)
+{
+  char cmd[1024], line[256], want[256];
+  unsigned long s;
+  FILE *p;
+  int ok;
+
+  snprintf(cmd, sizeof(cmd), "%s %s %s %llu %llu", window, TEST_VLB, TEST_IDX,
+           (unsigned long long)t_us, (unsigned long long)t_us);
+  p = popen(cmd, "r");
+  if (p == NULL)
+    return 0;
+  ok = fgets(line, sizeof(line), p) != NULL && sscanf(line, "-s %lu", &s) == 1 && s == sample;
+  if (pclose(p) != 0 || !ok)
+    return 0;
+
+  snprintf(cmd, sizeof(cmd), "%s -s %lu -n 1 %s %s", decoder, s, TEST_VLB, TEST_OUT);
+  if (system(cmd) != 0)
+    return 0;
+  p = fopen(TEST_OUT, "rb");
+  if (p == NULL)
+    return 0;
+  ok = fgets(line, sizeof(line), p) != NULL && fgets(line, sizeof(line), p) != NULL; // after the header
+  fclose(p);
+  sample_line(want, sample);
+  return ok && strcmp(line, want) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *decoder = argc > 1 ? argv[1] : "../vlog_decode";
+  const char *window = argc > 2 ? argv[2] : "../vlog_window";
+  static uint64_t target[1024];
+  static uint32_t found[1024];
+  file_t *log, *idx, *fill;
+  const entry_t *e;
+  uint32_t sample;
+  long index_offset;
+  int targets, i, bad_seek, bad_map, bad_frame, bad_tools;
+
+  img = open(TEST_IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (img < 0) { perror(TEST_IMAGE); return 2; }
+  img_sectors = IMAGE_MB * 1024 * 2;
+  if (ftruncate(img, (off_t)img_sectors * 512) != 0) { perror("ftruncate"); return 2; }
+  f_mount(0, &SDC_FS);
+  if (f_mkfs(0, 0, CLUSTER) != FR_OK) { printf("f_mkfs failed\n"); return 2; }
+  finit_();
+
+  // the log up to the seeks
+  log = fcreate_("TEST.VLB");
+  idx = fopen_("TEST.IDX", "w");
+  fill = fopen_("FILL.BIN", "w");
+  if (log == 0 || idx == 0 || fill == 0) { printf("open failed\n"); return 2; }
+  vlog_frame_init(&frame, CHANNELS, PERIOD_US);
+  vlog_index_init(&index_);
+  if (!put(log, vlog_put_header(rec, CH_MASK, PERIOD_US, zero, gain, filt)) ||
+      !put(idx, vlog_put_idx_header(rec, VLOG_FRAME_SAMPLES)) ||
+      !write_frames(log, idx, fill, HEAD_FRAMES))
+  {
+    printf("writing the log failed\n");
+    return 2;
+  }
+  fclose_(log);
+  fclose_(idx);
+
+  // seeks with the log open for append, as the logger would have it
+  log = fopen_("TEST.VLB", "a");
+  idx = fopen_("TEST.IDX", "r");
+  if (log == 0 || idx == 0) { printf("open failed\n"); return 2; }
+  check("the index takes a link map", !ffastseek_(idx));
+  idx->fil.cltbl = 0;
+
+  targets = seek_targets(target);
+  bad_seek = bad_map = 0;
+  for (i = 0; i < targets; i++)
+  {
+    e = expected_entry(target[i]);
+    if (!fseek_time_(log, idx, target[i], &sample) || sample != e->sample || ftell_(log) != e->offset)
+      bad_seek++;
+    if (log->fil.cltbl != 0 || idx->fil.cltbl != 0)
+      bad_map++;
+  }
+  check("seek lands on the last entry at or before the time", bad_seek);
+  check("no link map left on the handles", bad_map);
+
+  ffastseek_(idx);
+  check("a link map of the caller is kept",
+        !fseek_time_(log, idx, target[5], &sample) || idx->fil.cltbl == 0);
+  idx->fil.cltbl = 0;
+
+  // the rest of the log through the same handle, then the closing records
+  fclose_(idx);
+  idx = fopen_("TEST.IDX", "a");
+  check("the log takes more frames after the seeks",
+        idx == 0 || fseek_(log, fsize_(log)) != 0 || !write_frames(log, idx, fill, TAIL_FRAMES));
+  index_offset = ftell_(log);
+  check("the log takes its index and end records",
+        !put(log, vlog_put_index(rec, &index_)) || !put(log, vlog_put_end(rec, (uint32_t)index_offset)));
+  fclose_(log);
+  fclose_(idx);
+  fclose_(fill);
+
+  // what is at the seek position, for the whole log now
+  log = fopen_("TEST.VLB", "r");
+  idx = fopen_("TEST.IDX", "r");
+  targets = seek_targets(target);
+  bad_frame = 0;
+  for (i = 0; i < targets; i++)
+  {
+    if (!fseek_time_(log, idx, target[i], &found[i]) ||
+        fread_(rec, 1, VLOG_REC_HEADER_SIZE + 4, log) != VLOG_REC_HEADER_SIZE + 4 ||
+        rec[0] != VLOG_SYNC || rec[1] != VLOG_REC_FRAME || get_le32(rec + VLOG_REC_HEADER_SIZE) != found[i] ||
+        found[i] != expected_entry(target[i])->sample)
+      bad_frame++;
+  }
+  check("the record at the seek position is the frame of the sample", bad_frame);
+  fclose_(log);
+  fclose_(idx);
+
+  // the host tools on the same files
+  if (!extract("TEST.VLB", TEST_VLB) || !extract("TEST.IDX", TEST_IDX))
+  {
+    printf("copying the files out of the image failed\n");
+    return 2;
+  }
+  bad_tools = 0;
+  for (i = 0; i < targets; i += 10)
+    if (!tools_agree(decoder, window, target[i], found[i]))
+      bad_tools++;
+  check("vlog_window and vlog_decode agree with the seeks", bad_tools);
+
+  close(img);
+  if (failures == 0)
+  {
+    remove(TEST_IMAGE);
+    remove(TEST_VLB);
+    remove(TEST_IDX);
+    remove(TEST_OUT);
+  }
+  printf("%s\n", failures ? "FAILED" : "all passed");
+  return failures ? 1 : 0;
+}
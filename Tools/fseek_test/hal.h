@@ -0,0 +1 @@
+/* nothing of the HAL is used by file_utils.c, see ch.h */
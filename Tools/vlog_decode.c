@@ -0,0 +1,399 @@
+/*
+ * vlog_decode - converts a binary Voltage Logger file (.vlb) to CSV.
+ *
+ * The output has the same layout as the CSV the logger writes itself
+ * (Timestamp_us, calibrated channel values, #rtc, #can, #ser and #gps
+ * lines), so vlog_utc and the spreadsheets work on it unchanged. The sample values are reproduced exactly
+ * as the logger recorded them.
+ *
+ * Build:  cc -O2 -I../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY -o vlog_decode vlog_decode.c
+ * Usage:  vlog_decode [-r] [-f format] [-s first] [-n count] input.vlb [output.csv]
+ *         -r        write the recorded ADC codes instead of calibrated values
+ *         -f        printf format of the values, "%f" by default
+ *         -s, -n    only samples first .. first+count-1, found through the
+ *                   frame index without reading the file from the start
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vlog_format.h"
+
+static int channels = 0;
+static uint8_t channel_mask; // of the file header
+static int channel_no[VLOG_MAX_CHANNELS]; // 1-based channel number of each stored column
+static float zero[VLOG_MAX_CHANNELS];
+static float gain[VLOG_MAX_CHANNELS];
+static uint32_t period_us;
+static int frac_bits = VLOG_VALUE_FRAC_BITS;
+
+static int raw_output = 0;
+static const char *value_format = "%f";
+static unsigned long long first_sample = 0;
+static unsigned long long sample_count = ~0ULL;
+
+static uint16_t get_u16(const uint8_t *p)
+{
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+  return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static float get_f32(const uint8_t *p)
+{
+  uint32_t u = get_u32(p);
+  float f;
+
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+  uint32_t value = 0;
+  int shift = 0;
+
+  while (p < end && shift < 35)
+  {
+    value |= (uint32_t)(*p & 0x7F) << shift;
+    if ((*p++ & 0x80) == 0)
+    {
+      *v = value;
+      return p;
+    }
+    shift += 7;
+  }
+  return NULL;
+}
+
+static int parse_header(const uint8_t *p, uint16_t length)
+{
+  uint8_t mask;
+  int i;
+
+  if (length < 16 || get_u32(p) != VLOG_MAGIC)
+    return 0;
+  if (get_u16(p + 4) > VLOG_VERSION)
+    fprintf(stderr, "warning: file version %d is newer than this tool\n", get_u16(p + 4));
+
+  period_us = get_u32(p + 8);
+  mask = p[12];
+  channel_mask = mask;
+  frac_bits = p[13];
+  p += 16;
+
+  channels = 0;
+  for (i = 0; i < VLOG_MAX_CHANNELS; i++)
+  {
+    if (mask & (1 << i))
+    {
+      if (length < 16 + (channels + 1) * 12)
+        return 0;
+      channel_no[channels] = i + 1;
+      zero[channels] = get_f32(p);
+      gain[channels] = get_f32(p + 4);
+      p += 12;
+      channels++;
+    }
+  }
+  return 1;
+}
+
+static void write_sample(FILE *out, uint64_t time_us, const uint16_t *values)
+{
+  int i;
+  double v;
+
+  fprintf(out, "%llu", (unsigned long long)time_us);
+  for (i = 0; i < channels; i++)
+  {
+    v = (double)values[i] / (1 << frac_bits);
+    fputc(',', out);
+    if (raw_output)
+      fprintf(out, "%.4f", v);
+    else
+      fprintf(out, value_format, (v - zero[i]) * gain[i]);
+  }
+  fputs("\r\n", out);
+}
+
+// returns 0 when the frame is corrupted, -1 when the requested range is done
+static int decode_frame(FILE *out, const uint8_t *p, uint16_t length)
+{
+  const uint8_t *end = p + length;
+  uint16_t values[VLOG_MAX_CHANNELS];
+  uint64_t sample, time_us;
+  uint32_t u;
+  int count, n, i;
+
+  if (length < 14 + 2 * channels)
+    return 0;
+
+  sample = get_u32(p);
+  time_us = get_u64(p + 4);
+  count = get_u16(p + 12);
+  p += 14;
+  for (i = 0; i < channels; i++, p += 2)
+    values[i] = get_u16(p);
+
+  for (n = 0; n < count; n++)
+  {
+    if (n > 0)
+    {
+      if ((p = get_varint(p, end, &u)) == NULL)
+        return 0;
+      time_us += (int64_t)period_us + VLOG_UNZIGZAG(u);
+      for (i = 0; i < channels; i++)
+      {
+        if ((p = get_varint(p, end, &u)) == NULL)
+          return 0;
+        values[i] = (uint16_t)(values[i] + VLOG_UNZIGZAG(u));
+      }
+    }
+
+    if (sample >= first_sample + sample_count)
+      return -1;
+    if (sample >= first_sample)
+      write_sample(out, time_us, values);
+    sample++;
+  }
+  return 1;
+}
+
+// position of the last indexed frame starting at or before first_sample,
+// 0 if the file was not closed properly or has no index
+static long find_start(FILE *in)
+{
+  uint8_t end[VLOG_REC_END_SIZE];
+  uint8_t hdr[VLOG_REC_HEADER_SIZE];
+  uint8_t *idx;
+  uint32_t index_offset, entries, lo, hi, mid;
+  long pos = 0;
+
+  if (fseek(in, -VLOG_REC_END_SIZE, SEEK_END) != 0 || fread(end, 1, sizeof(end), in) != sizeof(end))
+    return 0;
+  if (end[0] != VLOG_SYNC || end[1] != VLOG_REC_END || get_u32(end + 8) != VLOG_END_MAGIC)
+    return 0;
+
+  index_offset = get_u32(end + 4);
+  if (fseek(in, index_offset, SEEK_SET) != 0 || fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr))
+    return 0;
+  if (hdr[0] != VLOG_SYNC || hdr[1] != VLOG_REC_INDEX || get_u16(hdr + 2) < 4)
+    return 0;
+
+  idx = malloc(get_u16(hdr + 2));
+  if (idx == NULL || fread(idx, 1, get_u16(hdr + 2), in) != get_u16(hdr + 2))
+  {
+    free(idx);
+    return 0;
+  }
+
+  entries = (get_u16(hdr + 2) - 4) / 8;
+  if (entries > 0 && get_u32(idx + 4) <= first_sample)
+  {
+    lo = 0;
+    hi = entries;
+    while (hi - lo > 1)
+    {
+      mid = (lo + hi) / 2;
+      if (get_u32(idx + 4 + mid * 8) <= first_sample)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    pos = get_u32(idx + 4 + lo * 8 + 4);
+  }
+  free(idx);
+  return pos;
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *in, *out = stdout;
+  static uint8_t payload[65536];
+  uint8_t hdr[VLOG_REC_HEADER_SIZE];
+  uint16_t length;
+  long start;
+  int running;
+  int res, i, c;
+  int argi = 1;
+
+  while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != 0)
+  {
+    if (strcmp(argv[argi], "-r") == 0)
+      raw_output = 1;
+    else
+    if (strcmp(argv[argi], "-f") == 0 && argi + 1 < argc)
+      value_format = argv[++argi];
+    else
+    if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc)
+      first_sample = strtoull(argv[++argi], NULL, 10);
+    else
+    if (strcmp(argv[argi], "-n") == 0 && argi + 1 < argc)
+      sample_count = strtoull(argv[++argi], NULL, 10);
+    else
+      break;
+    argi++;
+  }
+  if (argi >= argc || argi + 2 < argc)
+  {
+    fprintf(stderr, "usage: vlog_decode [-r] [-f format] [-s first] [-n count] input.vlb [output.csv]\n");
+    return 2;
+  }
+
+  in = fopen(argv[argi], "rb");
+  if (in == NULL)
+  {
+    perror(argv[argi]);
+    return 1;
+  }
+  if (argi + 1 < argc)
+  {
+    out = fopen(argv[argi + 1], "wb");
+    if (out == NULL)
+    {
+      perror(argv[argi + 1]);
+      return 1;
+    }
+  }
+
+  // the file header is always the first record
+  if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) || hdr[0] != VLOG_SYNC || hdr[1] != VLOG_REC_FILE_HEADER ||
+      fread(payload, 1, get_u16(hdr + 2), in) != get_u16(hdr + 2) || !parse_header(payload, get_u16(hdr + 2)))
+  {
+    fprintf(stderr, "%s: not a voltage logger binary file\n", argv[argi]);
+    return 1;
+  }
+
+  fputs("Timestamp_us", out);
+  for (i = 0; i < channels; i++)
+    fprintf(out, ",ch #%d", channel_no[i]);
+  fputs("\r\n", out);
+
+  start = first_sample > 0 ? find_start(in) : 0;
+  fseek(in, start > 0 ? start : (long)(VLOG_REC_HEADER_SIZE + get_u16(hdr + 2)), SEEK_SET);
+  running = 1;
+
+  while (running)
+  {
+    c = fgetc(in);
+    if (c == EOF)
+      break;
+    if (c != VLOG_SYNC)
+      continue; // lost the record boundary (e.g. the file was cut), resync
+
+    if (fread(hdr + 1, 1, 3, in) != 3)
+      break;
+    length = get_u16(hdr + 2);
+    if (fread(payload, 1, length, in) != length)
+      break;
+
+    switch (hdr[1])
+    {
+    case VLOG_REC_FRAME:
+      res = decode_frame(out, payload, length);
+      if (res < 0)
+        running = 0;
+      else
+      if (res == 0)
+        fprintf(stderr, "warning: corrupted frame skipped\n");
+      break;
+
+    case VLOG_REC_RTC:
+      if (length >= 16)
+        fprintf(out, "#rtc,%llu,%llu\r\n",
+                (unsigned long long)get_u64(payload), (unsigned long long)get_u64(payload + 8));
+      break;
+
+    case VLOG_REC_TRIGGER:
+      if (length >= 8)
+        fprintf(out, "#trigger,%llu\r\n", (unsigned long long)get_u64(payload));
+      break;
+
+    case VLOG_REC_CONFIG:
+      // the channel settings changed while logging, the samples after it use the new ones
+      if (length >= 16 && payload[12] == channel_mask && length >= 16 + channels * 12)
+      {
+        int i;
+
+        fprintf(out, "#config,%llu,%lu", (unsigned long long)get_u64(payload),
+                (unsigned long)get_u32(payload + 8));
+        for (i = 0; i < channels; i++)
+        {
+          zero[i] = get_f32(payload + 16 + i * 12);
+          gain[i] = get_f32(payload + 16 + i * 12 + 4);
+          fprintf(out, ",%g,%g,%g", zero[i], gain[i], get_f32(payload + 16 + i * 12 + 8));
+        }
+        fputs("\r\n", out);
+      }
+      break;
+
+    case VLOG_REC_CAN:
+      if (length >= 14)
+      {
+        uint32_t id = get_u32(payload + 8);
+        int i;
+
+        fprintf(out, "#can,%llu,%u,", (unsigned long long)get_u64(payload), payload[12]);
+        if (id & VLOG_CAN_EXT)
+          fprintf(out, "%08lX,", (unsigned long)(id & 0x1FFFFFFFUL));
+        else
+          fprintf(out, "%03lX,", (unsigned long)(id & 0x7FFUL));
+        fprintf(out, "%u,", payload[13]);
+        if (id & VLOG_CAN_RTR)
+          fputs("R", out);
+        else
+          for (i = 14; i < length; i++)
+            fprintf(out, "%02X", payload[i]);
+        fputs("\r\n", out);
+      }
+      break;
+
+    case VLOG_REC_SERIAL:
+      if (length >= 10)
+      {
+        int i;
+
+        fprintf(out, "%s,%llu,%u,", payload[9] == 0 ? "#ser" : "#serb",
+                (unsigned long long)get_u64(payload), payload[8]);
+        for (i = 10; i < length; i++)
+        {
+          if (payload[9] == 0 && payload[i] >= 0x20 && payload[i] < 0x7F && payload[i] != '\\')
+            fputc(payload[i], out);
+          else
+            fprintf(out, payload[9] == 0 ? "\\x%02X" : "%02X", payload[i]);
+        }
+        fputs("\r\n", out);
+      }
+      break;
+
+    case VLOG_REC_GPS:
+      if (length >= 16)
+        fprintf(out, "#gps,%llu,%llu\r\n",
+                (unsigned long long)get_u64(payload), (unsigned long long)get_u64(payload + 8));
+      break;
+
+    case VLOG_REC_END:
+      running = 0;
+      break;
+
+    default: // padding, index and record types of newer firmware
+      break;
+    }
+  }
+
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+
+  return 0;
+}
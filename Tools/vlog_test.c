@@ -0,0 +1,310 @@
+/*
+ * vlog_test - round trip of the binary log format: encodes known records
+ * with the firmware's vlog_bin.c, decodes them with vlog_decode and compares
+ * the CSV with what the records hold.
+ *
+ * Covers the frame coding at its limits (full scale value steps up and down,
+ * time jumps of +-2^31 us that need 5 varint bytes, frames split at
+ * VLOG_FRAME_SAMPLES), the seek through the frame index (-s/-n) and every
+ * record type vlog_decode prints: trigger, CAN (11/29-bit, remote), serial
+ * (text and binary), RTC, GPS and config.
+ *
+ * Build:  cc -O2 -I../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY -o vlog_test vlog_test.c \
+ *            ../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY/vlog_bin.c
+ * Usage:  vlog_test [path of vlog_decode]     (./vlog_decode by default)
+ *         exit code 0 when every check passes
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vlog_bin.h"
+
+#define TEST_FILE   "vlog_test.vlb"
+#define TEST_OUT    "vlog_test.csv"
+#define CHANNELS    2
+#define CH_MASK     0x05 // ch #1 and ch #3
+#define PERIOD_US   1000
+#define WALK        400  // samples of the random walk part
+
+static FILE *vlb;
+static uint8_t rec[65536];
+static vlog_frame_t frame;
+static vlog_index_t index_;
+static uint32_t sample_no = 0;
+static uint32_t frame_first;
+
+// by channel number, as the firmware passes them
+static const int column_ch[CHANNELS] = { 0, 2 };
+static float zero[VLOG_MAX_CHANNELS] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+static float gain[VLOG_MAX_CHANNELS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+static float filt[VLOG_MAX_CHANNELS] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+
+static char *expected;
+static size_t expected_length = 0;
+static size_t expected_size = 0;
+
+static int failures = 0;
+
+static void expect(const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  if (expected_size - expected_length < 1024)
+  {
+    expected_size = expected_size * 2 + 65536;
+    expected = realloc(expected, expected_size);
+  }
+  va_start(ap, fmt);
+  n = vsnprintf(expected + expected_length, expected_size - expected_length, fmt, ap);
+  va_end(ap);
+  expected_length += n;
+}
+
+static void put(uint16_t length)
+{
+  fwrite(rec, 1, length, vlb);
+}
+
+// the CSV line vlog_decode writes for a sample (default "%f" format)
+static void expect_sample(uint64_t time_us, const uint16_t *values)
+{
+  double v;
+  int i;
+
+  expect("%llu", (unsigned long long)time_us);
+  for (i = 0; i < CHANNELS; i++)
+  {
+    v = (double)values[i] / (1 << VLOG_VALUE_FRAC_BITS);
+    expect(",%f", (v - zero[column_ch[i]]) * gain[column_ch[i]]);
+  }
+  expect("\r\n");
+}
+
+static void flush_frame(void)
+{
+  long offset = ftell(vlb);
+  uint16_t length = vlog_frame_close(&frame);
+
+  if (length == 0) return;
+  vlog_index_add(&index_, frame_first, (uint32_t)offset);
+  fwrite(frame.buf, 1, length, vlb);
+}
+
+static void add_sample(uint64_t time_us, const uint16_t *values)
+{
+  if (frame.count == 0)
+    frame_first = sample_no;
+  vlog_frame_add(&frame, sample_no, time_us, values);
+  expect_sample(time_us, values);
+  sample_no++;
+  if (frame.count == VLOG_FRAME_SAMPLES)
+    flush_frame();
+}
+
+static uint32_t rnd(void)
+{
+  static uint32_t state = 12345;
+
+  state = state * 1103515245UL + 12345;
+  return state >> 8;
+}
+
+// writes the test log, the expected CSV goes to expected
+static void write_log(void)
+{
+  static const uint8_t can_data[8] = { 0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF };
+  static const char nmea[] = "$GPRMC,123519,A,4807.038,N,01131.000,E,022.4,084.4,230394,003.1,W*6A";
+  static const uint8_t bin[5] = { 0x00, 0x5C, 0xFF, 0x0A, 0x7F };
+  static const float poly[4] = { 1.5f, 0.25f, 0, 0 };
+  uint16_t v[CHANNELS];
+  uint64_t t;
+  long index_offset;
+  int i, k;
+
+  expect("Timestamp_us,ch #1,ch #3\r\n");
+  put(vlog_put_header(rec, CH_MASK, PERIOD_US, zero, gain, filt));
+  put(vlog_put_calib(rec, 0, VLOG_CALIB_POLY, 4, poly)); // not printed
+  put(vlog_put_rtc(rec, 1700000000000000ULL, 0));
+  expect("#rtc,1700000000000000,0\r\n");
+
+  vlog_frame_init(&frame, CHANNELS, PERIOD_US);
+  vlog_index_init(&index_);
+
+  // the limits of the delta coding
+  t = 0;
+  v[0] = 0;      v[1] = 0xFFFF; add_sample(t, v);
+  v[0] = 0xFFFF; v[1] = 0;      add_sample(t += PERIOD_US, v);             // +-65535
+  v[0] = 1;      v[1] = 0x8000; add_sample(t += 0x7FFFFFFFUL, v);          // dt - period near +2^31
+  v[0] = 0;      v[1] = 0x7FFF; add_sample(t += PERIOD_US, v);             // -1 steps
+  v[0] = 0;      v[1] = 0x7FFF; add_sample(t -= 0x80000000UL - PERIOD_US, v); // dt - period = -2^31
+  v[0] = 0x1234; v[1] = 0x4321; add_sample(t += PERIOD_US + 1, v);
+  v[0] = 0x1234; v[1] = 0x4321; add_sample(t += PERIOD_US - 1, v);
+  v[0] = 0x1234; v[1] = 0x4321; add_sample(t += 0, v);                    // same time
+  flush_frame();
+
+  put(vlog_put_trigger(rec, t));
+  expect("#trigger,%llu\r\n", (unsigned long long)t);
+  put(vlog_put_can(rec, t + 10, 0x123, 1, 8, can_data));
+  expect("#can,%llu,1,123,8,0123456789ABCDEF\r\n", (unsigned long long)(t + 10));
+  put(vlog_put_can(rec, t + 20, 0x18FEF100UL | VLOG_CAN_EXT, 2, 3, can_data));
+  expect("#can,%llu,2,18FEF100,3,012345\r\n", (unsigned long long)(t + 20));
+  put(vlog_put_can(rec, t + 30, 0x7FF | VLOG_CAN_RTR, 1, 4, can_data));
+  expect("#can,%llu,1,7FF,4,R\r\n", (unsigned long long)(t + 30));
+  put(vlog_put_serial(rec, t + 40, 6, 0, (uint16_t)strlen(nmea), (const uint8_t *)nmea));
+  expect("#ser,%llu,6,%s\r\n", (unsigned long long)(t + 40), nmea);
+  put(vlog_put_serial(rec, t + 50, 2, 0, sizeof(bin), bin));
+  expect("#ser,%llu,2,\\x00\\x5C\\xFF\\x0A\\x7F\r\n", (unsigned long long)(t + 50));
+  put(vlog_put_serial(rec, t + 60, 3, 1, sizeof(bin), bin));
+  expect("#serb,%llu,3,005CFF0A7F\r\n", (unsigned long long)(t + 60));
+  put(vlog_put_gps(rec, 1700000001000000ULL, t + 70));
+  expect("#gps,1700000001000000,%llu\r\n", (unsigned long long)(t + 70));
+  put(vlog_put_pad(rec, 13)); // not printed
+
+  // a random walk over several frames, for the index
+  for (i = 0; i < WALK; i++)
+  {
+    t += PERIOD_US + (rnd() % 101) - 50;
+    if (rnd() % 50 == 0)
+      t += rnd() % 100000; // a pause
+    for (k = 0; k < CHANNELS; k++)
+    {
+      if (rnd() % 40 == 0)
+        v[k] = (uint16_t)rnd(); // anywhere
+      else
+        v[k] = (uint16_t)(v[k] + (rnd() % 601) - 300);
+    }
+    add_sample(t, v);
+  }
+  flush_frame();
+
+  // new calibration from here on
+  zero[0] = 1.5f; gain[0] = 2;
+  zero[2] = -4;   gain[2] = 0.5f;
+  put(vlog_put_config(rec, t + PERIOD_US, 7, CH_MASK, zero, gain, filt));
+  expect("#config,%llu,7", (unsigned long long)(t + PERIOD_US));
+  for (k = 0; k < CHANNELS; k++)
+    expect(",%g,%g,%g", zero[column_ch[k]], gain[column_ch[k]], filt[column_ch[k]]);
+  expect("\r\n");
+  for (i = 0; i < 5; i++)
+  {
+    v[0] = (uint16_t)(100 * i);
+    v[1] = (uint16_t)(0xFFFF - 100 * i);
+    add_sample(t += PERIOD_US, v);
+  }
+  flush_frame();
+
+  index_offset = ftell(vlb);
+  put(vlog_put_index(rec, &index_));
+  put(vlog_put_end(rec, (uint32_t)index_offset));
+}
+
+// runs the decoder with args, returns its output or NULL
+static char *decode(const char *decoder, const char *args)
+{
+  char cmd[1024];
+  FILE *f;
+  char *out;
+  long size;
+
+  snprintf(cmd, sizeof(cmd), "%s %s %s %s", decoder, args, TEST_FILE, TEST_OUT);
+  if (system(cmd) != 0)
+    return NULL;
+
+  f = fopen(TEST_OUT, "rb");
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  out = malloc(size + 1);
+  if (fread(out, 1, size, f) != (size_t)size)
+    size = 0;
+  out[size] = 0;
+  fclose(f);
+  return out;
+}
+
+static void check(const char *name, const char *got, const char *want)
+{
+  int line = 1;
+  size_t i;
+
+  if (got == NULL)
+  {
+    printf("FAIL %s: the decoder failed\n", name);
+    failures++;
+    return;
+  }
+  if (strcmp(got, want) == 0)
+  {
+    printf("ok   %s\n", name);
+    return;
+  }
+
+  for (i = 0; got[i] == want[i]; i++)
+    if (got[i] == '\n') line++;
+  printf("FAIL %s: output differs at line %d\n", name, line);
+  failures++;
+}
+
+// the lines of text from line first (0 = the first) on, count lines
+static char *lines(const char *text, int first, int count)
+{
+  const char *s = text, *e;
+  char *r;
+
+  while (first-- > 0 && (s = strchr(s, '\n')) != NULL)
+    s++;
+  if (s == NULL)
+    return strdup("");
+  for (e = s; count-- > 0 && (e = strchr(e, '\n')) != NULL; e++);
+  if (e == NULL)
+    e = s + strlen(s);
+  r = malloc(e - s + 1);
+  memcpy(r, s, e - s);
+  r[e - s] = 0;
+  return r;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *decoder = argc > 1 ? argv[1] : "./vlog_decode";
+  char *got, *want, *part;
+  size_t head;
+
+  vlb = fopen(TEST_FILE, "wb");
+  if (vlb == NULL)
+  {
+    perror(TEST_FILE);
+    return 2;
+  }
+  write_log();
+  fclose(vlb);
+
+  got = decode(decoder, "");
+  check("round trip", got, expected);
+  free(got);
+
+  // samples 200..209: the header line, then the lines of those samples; the
+  // header and #rtc lines and the 8 samples of the first frame are followed
+  // by 8 record lines
+  got = decode(decoder, "-s 200 -n 10");
+  head = strchr(expected, '\n') + 1 - expected;
+  part = lines(expected, 2 + 8 + 8 + 200 - 8, 10);
+  want = malloc(head + strlen(part) + 1);
+  memcpy(want, expected, head);
+  strcpy(want + head, part);
+  check("seek through the frame index", got, want);
+  free(got);
+  free(want);
+  free(part);
+
+  if (failures == 0) remove(TEST_FILE);
+  if (failures == 0) remove(TEST_OUT);
+  printf("%s\n", failures ? "FAILED" : "all passed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * vlog_utc - rewrites the timestamp column of a Voltage Logger CSV to UTC.
+ *
+ * The logger writes sample times in microseconds of its free-running timer
+ * ("Timestamp_us" since log start, or "dt_us" deltas between rows) and, every
+ * rtc_sync seconds, a line
+ *
+ *     #rtc,<RTC unix time, us>,<timer us since log start>
+ *
+ * The pairs are averaged over windows (-w, default 600 s) to get rid of the
+ * RTC read-out jitter, and sample times are interpolated piecewise-linearly
+ * between the window averages. That follows the drift of the timer crystal
+ * against the RTC, also when it changes with temperature over long runs.
+ *
+ * With a GPS on a serial port (gps_port) the log has lines
+ *
+ *     #gps,<UTC unix time, us>,<timer us since log start>
+ *
+ * instead, the PPS edge of every second with gps_pps; they are used in place
+ * of the #rtc lines when there are any.
+ *
+ * Build:  cc -O2 -o vlog_utc vlog_utc.c
+ * Usage:  vlog_utc [-w seconds] [-u] input.csv [output.csv]
+ *         -u writes unix microseconds instead of ISO 8601 text
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LINE_LENGTH 8192
+
+typedef struct
+{
+  double tb;  // timer, us since log start
+  double rtc; // RTC, us since the first pair
+} knot_t;
+
+static knot_t *knots = NULL;
+static int knot_count = 0;
+static int knot_alloc = 0;
+
+static long long rtc_base; // unix us of the first pair
+
+static void add_knot(double tb, double rtc)
+{
+  if (knot_count == knot_alloc)
+  {
+    knot_alloc = knot_alloc ? knot_alloc * 2 : 64;
+    knots = realloc(knots, knot_alloc * sizeof(knot_t));
+    if (knots == NULL)
+    {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  knots[knot_count].tb = tb;
+  knots[knot_count].rtc = rtc;
+  knot_count++;
+}
+
+// timer us since log start -> unix us
+static long long to_utc(double tb)
+{
+  int lo = 0, hi = knot_count - 1, mid;
+  double slope;
+
+  if (knot_count == 1)
+    return rtc_base + (long long)(knots[0].rtc + (tb - knots[0].tb));
+
+  // segment containing tb, the end segments are extrapolated
+  while (hi - lo > 1)
+  {
+    mid = (lo + hi) / 2;
+    if (knots[mid].tb <= tb)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  slope = (knots[hi].rtc - knots[lo].rtc) / (knots[hi].tb - knots[lo].tb);
+  return rtc_base + (long long)(knots[lo].rtc + (tb - knots[lo].tb) * slope + 0.5);
+}
+
+static void format_iso(char *dst, long long unix_us)
+{
+  time_t sec = (time_t)(unix_us / 1000000);
+  long usec = (long)(unix_us % 1000000);
+  struct tm *tm;
+
+  if (usec < 0)
+  {
+    usec += 1000000;
+    sec--;
+  }
+  tm = gmtime(&sec);
+  sprintf(dst, "%04d-%02d-%02dT%02d:%02d:%02d.%06ldZ",
+          tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+          tm->tm_hour, tm->tm_min, tm->tm_sec, usec);
+}
+
+// pass 1: collect the (RTC, timer) pairs and average them per window,
+// pattern is the #rtc or #gps line
+static int read_pairs(FILE *in, double window_us, const char *pattern)
+{
+  char line[LINE_LENGTH];
+  long long rtc, tb;
+  double sum_tb = 0, sum_rtc = 0, win_start = 0;
+  int n = 0, pairs = 0;
+
+  while (fgets(line, sizeof(line), in))
+  {
+    if (sscanf(line, pattern, &rtc, &tb) != 2)
+      continue;
+
+    if (pairs == 0)
+      rtc_base = rtc;
+    pairs++;
+
+    if (n > 0 && tb - win_start >= window_us)
+    {
+      add_knot(sum_tb / n, sum_rtc / n);
+      n = 0;
+      sum_tb = sum_rtc = 0;
+    }
+    if (n == 0)
+      win_start = (double)tb;
+
+    sum_tb += (double)tb;
+    sum_rtc += (double)(rtc - rtc_base);
+    n++;
+  }
+  if (n > 0)
+    add_knot(sum_tb / n, sum_rtc / n);
+
+  return pairs;
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *in, *out = stdout;
+  char line[LINE_LENGTH];
+  char stamp[80];
+  double window_us = 600e6;
+  int unix_out = 0;
+  int delta = -1; // unknown until the header is seen
+  long long t = 0;
+  char *rest;
+  int argi = 1;
+
+  while (argi < argc && argv[argi][0] == '-')
+  {
+    if (strcmp(argv[argi], "-w") == 0 && argi + 1 < argc)
+      window_us = atof(argv[++argi]) * 1e6;
+    else
+    if (strcmp(argv[argi], "-u") == 0)
+      unix_out = 1;
+    else
+      break;
+    argi++;
+  }
+  if (argi >= argc || argi + 2 < argc)
+  {
+    fprintf(stderr, "usage: vlog_utc [-w seconds] [-u] input.csv [output.csv]\n");
+    return 2;
+  }
+
+  in = fopen(argv[argi], "rb");
+  if (in == NULL)
+  {
+    perror(argv[argi]);
+    return 1;
+  }
+  if (argi + 1 < argc)
+  {
+    out = fopen(argv[argi + 1], "wb");
+    if (out == NULL)
+    {
+      perror(argv[argi + 1]);
+      return 1;
+    }
+  }
+
+  if (read_pairs(in, window_us, "#gps,%lld,%lld") == 0 &&
+      (rewind(in), read_pairs(in, window_us, "#rtc,%lld,%lld")) == 0)
+  {
+    fprintf(stderr, "%s: no #rtc lines, the log was written by older firmware\n", argv[argi]);
+    return 1;
+  }
+  rewind(in);
+
+  // pass 2: replace the first column, everything else is copied as is
+  while (fgets(line, sizeof(line), in))
+  {
+    if (line[0] == '#')
+    {
+      fputs(line, out);
+      continue;
+    }
+
+    if (delta < 0)
+    {
+      if (strncmp(line, "Timestamp_us", 12) == 0)
+        delta = 0;
+      else
+      if (strncmp(line, "dt_us", 5) == 0)
+        delta = 1;
+      else
+      {
+        fprintf(stderr, "%s: log has no microsecond timestamp column\n", argv[argi]);
+        return 1;
+      }
+      rest = strchr(line, ',');
+      fprintf(out, "Timestamp_utc%s", rest ? rest : "\r\n");
+      continue;
+    }
+
+    // sector padding rows have an empty first column
+    if (line[0] < '0' || line[0] > '9')
+    {
+      fputs(line, out);
+      continue;
+    }
+
+    if (delta)
+      t += strtoll(line, &rest, 10);
+    else
+      t = strtoll(line, &rest, 10);
+
+    if (unix_out)
+      sprintf(stamp, "%lld", to_utc((double)t));
+    else
+      format_iso(stamp, to_utc((double)t));
+
+    fputs(stamp, out);
+    fputs(rest, out);
+  }
+
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+
+  return 0;
+}
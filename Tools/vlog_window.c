@@ -0,0 +1,189 @@
+/*
+ * vlog_window - cuts a time window out of a Voltage Logger log, using the
+ * sidecar index (.idx) the logger writes next to every log file.
+ *
+ * The index holds the file offset of every index_every-th record, so only
+ * the part of the log around the window is read, however large the file.
+ * For a CSV log the header lines and the records from from_us to to_us
+ * (us since log start, the logger's Timestamp_us) are copied; with
+ * "timestamp 2" (dt_us) the timestamps can not be compared, the indexed
+ * records around the window are copied whole. For a binary log (.vlb) the
+ * matching sample range is printed as vlog_decode -s/-n arguments.
+ *
+ * Build:  cc -O2 -I../Firmware/IAR/demos/ARMCM4-STM32F407-DISCOVERY -o vlog_window vlog_window.c
+ * Usage:  vlog_window log.csv|log.vlb log.idx from_us to_us [output.csv]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vlog_format.h"
+
+#define LINE_LENGTH 8192
+
+typedef struct
+{
+  uint32_t sample;
+  uint32_t offset;
+  uint64_t time_us;
+} entry_t;
+
+static entry_t *entries = NULL;
+static long entry_count = 0;
+
+static uint32_t get_u32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int load_index(const char *name)
+{
+  FILE *f = fopen(name, "rb");
+  uint8_t b[VLOG_IDX_HEADER_SIZE];
+  long alloc = 0;
+
+  if (f == NULL)
+  {
+    perror(name);
+    return 0;
+  }
+  if (fread(b, 1, VLOG_IDX_HEADER_SIZE, f) != VLOG_IDX_HEADER_SIZE || get_u32(b) != VLOG_IDX_MAGIC ||
+      (b[6] | (b[7] << 8)) != VLOG_IDX_ENTRY_SIZE)
+  {
+    fprintf(stderr, "%s: not a log index\n", name);
+    fclose(f);
+    return 0;
+  }
+
+  // a partly written last entry (power lost while logging) is dropped
+  while (fread(b, 1, VLOG_IDX_ENTRY_SIZE, f) == VLOG_IDX_ENTRY_SIZE)
+  {
+    if (entry_count == alloc)
+    {
+      alloc = alloc ? alloc * 2 : 1024;
+      entries = realloc(entries, alloc * sizeof(entry_t));
+      if (entries == NULL)
+      {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+      }
+    }
+    entries[entry_count].sample = get_u32(b);
+    entries[entry_count].offset = get_u32(b + 4);
+    entries[entry_count].time_us = get_u32(b + 8) | ((uint64_t)get_u32(b + 12) << 32);
+    entry_count++;
+  }
+
+  fclose(f);
+  return 1;
+}
+
+// last entry at or before t, 0 if t is before all of them
+static long find_entry(uint64_t t)
+{
+  long lo = 0, hi = entry_count;
+
+  while (hi - lo > 1)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (entries[mid].time_us <= t)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int main(int argc, char **argv)
+{
+  FILE *in, *out = stdout;
+  static char line[LINE_LENGTH];
+  unsigned long long from_us, to_us;
+  long first, last;
+  int absolute;
+  size_t len;
+
+  if (argc < 5)
+  {
+    fprintf(stderr, "usage: vlog_window log.csv|log.vlb log.idx from_us to_us [output.csv]\n");
+    return 1;
+  }
+  from_us = strtoull(argv[3], NULL, 10);
+  to_us = strtoull(argv[4], NULL, 10);
+
+  if (!load_index(argv[2]))
+    return 1;
+  if (entry_count == 0)
+  {
+    fprintf(stderr, "%s: no entries\n", argv[2]);
+    return 1;
+  }
+
+  // indexed records around the window: entries[first] .. entries[last] (excluded)
+  first = find_entry(from_us);
+  last = find_entry(to_us) + 1;
+
+  len = strlen(argv[1]);
+  if (len > 4 && strcmp(argv[1] + len - 4, ".vlb") == 0)
+  {
+    // entries point at frames, vlog_decode finds the frames through its own index
+    unsigned long long n = last < entry_count ? (unsigned long long)entries[last].sample - entries[first].sample : 0;
+    if (n)
+      printf("-s %lu -n %llu\n", (unsigned long)entries[first].sample, n);
+    else
+      printf("-s %lu\n", (unsigned long)entries[first].sample);
+    return 0;
+  }
+
+  in = fopen(argv[1], "rb");
+  if (in == NULL)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+  if (argc > 5)
+  {
+    out = fopen(argv[5], "wb");
+    if (out == NULL)
+    {
+      perror(argv[5]);
+      return 1;
+    }
+  }
+
+  // header: everything before the first record
+  if (fgets(line, LINE_LENGTH, in) == NULL)
+  {
+    fprintf(stderr, "%s: empty\n", argv[1]);
+    return 1;
+  }
+  absolute = strncmp(line, "Timestamp_us", 12) == 0;
+  fputs(line, out);
+  while (ftell(in) < (long)entries[0].offset && fgets(line, LINE_LENGTH, in) != NULL)
+    fputs(line, out);
+
+  if (fseek(in, (long)entries[first].offset, SEEK_SET) != 0)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+  while ((last >= entry_count || ftell(in) < (long)entries[last].offset) && fgets(line, LINE_LENGTH, in) != NULL)
+  {
+    unsigned long long t;
+
+    // # lines (rtc anchors, trigger marks) pass through
+    if (absolute && line[0] >= '0' && line[0] <= '9')
+    {
+      t = strtoull(line, NULL, 10);
+      if (t < from_us) continue;
+      if (t > to_us) break;
+    }
+    fputs(line, out);
+  }
+
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}